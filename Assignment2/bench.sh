@@ -0,0 +1,86 @@
+#!/bin/sh
+# Benchmark and regression gate for distances (make bench).
+# For every dataset (points x distribution, fixed seed) it generates the cells file,
+# computes a reference histogram with the brute-force reference (reference.c, which
+# shares no code with distances), then runs distances for every thread count
+# and memory budget. Each run is checked against the reference and its pairs/s is taken
+# from the JSON report (-j). Results go to $BENCH_DIR/results.csv; the exit status is
+# non-zero if any run differs from the reference.
+#
+# Settings, from the environment:
+#   BENCH_POINTS         dataset sizes                       (default "20000 50000")
+#   BENCH_DISTRIBUTIONS  generate_cells distributions        (default "uniform clustered dup")
+#   BENCH_SEED           generator seed                      (default 1)
+#   BENCH_THREADS        thread counts                       (default "1 2 4")
+#   BENCH_BUDGETS        -m budgets, "-" for the default     (default "- 1M")
+#   BENCH_ARGS           extra distances options             (default none)
+#   BENCH_DIR            work directory                      (default bench)
+#   REFERENCE            binary for the reference histogram  (default ./reference)
+#   REFERENCE_THREADS    threads of the reference            (default 4)
+
+POINTS=${BENCH_POINTS:-"20000 50000"}
+DISTRIBUTIONS=${BENCH_DISTRIBUTIONS:-"uniform clustered dup"}
+SEED=${BENCH_SEED:-1}
+THREADS=${BENCH_THREADS:-"1 2 4"}
+BUDGETS=${BENCH_BUDGETS:-"- 1M"}
+ARGS=${BENCH_ARGS:-}
+DIR=${BENCH_DIR:-bench}
+HERE=$(pwd)
+DISTANCES="$HERE/distances"
+GENERATE="$HERE/generate_cells"
+REF_THREADS=${REFERENCE_THREADS:-4}
+case ${REFERENCE:-./reference} in
+    /*) REF_BIN=${REFERENCE} ;;
+    *) REF_BIN="$HERE/${REFERENCE:-./reference}" ;;
+esac
+
+mkdir -p "$DIR" || exit 1
+RESULTS="$DIR/results.csv"
+echo "points,distribution,threads,budget,seconds,pairs_per_second,efficiency,correct" > "$RESULTS"
+failures=0
+
+# top-level number of the JSON report, empty if the run wrote none
+json_value() {
+    [ -f "$1" ] && sed -n "s/^  \"$2\": \([0-9.e+-]*\),*$/\1/p" "$1"
+}
+
+for points in $POINTS; do
+    for distribution in $DISTRIBUTIONS; do
+        data="$DIR/$distribution-$points-$SEED"
+        mkdir -p "$data" || exit 1
+        "$GENERATE" -n"$points" -s"$SEED" -d"$distribution" -o"$data/cells" > /dev/null || exit 1
+        (cd "$data" && "$REF_BIN" -t"$REF_THREADS" > reference.txt) || exit 1
+
+        base=""
+        for threads in $THREADS; do
+            for budget in $BUDGETS; do
+                memory=""
+                [ "$budget" != "-" ] && memory="-m$budget"
+                rm -f "$data/report.json"
+                (cd "$data" && "$DISTANCES" -t"$threads" $memory $ARGS -jreport.json > output.txt)
+                if [ $? -eq 0 ] && cmp -s "$data/output.txt" "$data/reference.txt"; then
+                    correct=yes
+                else
+                    correct=NO
+                    failures=$((failures + 1))
+                fi
+                seconds=$(json_value "$data/report.json" seconds)
+                rate=$(json_value "$data/report.json" pairs_per_second)
+                # efficiency against the first thread count with the same budget
+                [ "$threads" = "${THREADS%% *}" ] && eval "base_$(echo "$budget" | tr -c 'a-zA-Z0-9\n' _)=$rate"
+                base=$(eval echo "\$base_$(echo "$budget" | tr -c 'a-zA-Z0-9\n' _)")
+                efficiency=$(awk -v r="$rate" -v b="$base" -v t="$threads" -v t0="${THREADS%% *}" \
+                    'BEGIN { if (r != "" && b > 0) printf "%.3f", r / b * t0 / t; else print "" }')
+                echo "$points,$distribution,$threads,$budget,$seconds,$rate,$efficiency,$correct" >> "$RESULTS"
+                printf "%9s %-10s t=%-3s m=%-5s %10ss %12s pairs/s  eff %-6s %s\n" "$points" "$distribution" \
+                    "$threads" "$budget" "$seconds" "$rate" "$efficiency" "$correct"
+            done
+        done
+    done
+done
+
+echo "results in $RESULTS"
+if [ "$failures" -ne 0 ]; then
+    echo "$failures runs differ from the reference"
+    exit 1
+fi
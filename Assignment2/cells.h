@@ -0,0 +1,54 @@
+#ifndef CELLS_H
+#define CELLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* File formats of the cell coordinates, shared by distances.c and the tools around it.
+Coordinates lie in [-10, 10] with three decimals and are stored as int16 in units of 0.001.
+*/
+
+/* Text format: every line is a fixed 24-byte record "+01.234 -05.678 +09.012\n",
+the last one possibly without its newline. */
+#define RECORD_SIZE 24
+
+// "+01.234" -> 1234 without branches, the sign byte is '+' (43) or '-' (45)
+static inline int16_t parse_coord(const char *str)
+{
+    int value = (str[1] - '0') * 10000 + (str[2] - '0') * 1000
+        + (str[4] - '0') * 100 + (str[5] - '0') * 10 + (str[6] - '0');
+    return (int16_t)(value * ('+' + 1 - str[0]));
+}
+
+/* Binary format: a cells_header_t followed by num_points packed little-endian int16
+(x, y, z) triplets, 6 bytes per point instead of 24. The checksum is a 64-bit FNV-1a
+over the coordinates in file order, one 16-bit coordinate per step.
+*/
+#define CELLS_MAGIC "CELB"
+#define CELLS_VERSION 1
+#define BINARY_RECORD_SIZE 6
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t num_points;
+    uint64_t checksum;
+} cells_header_t;
+
+static inline uint64_t checksum_update(uint64_t hash, const int16_t *coords, size_t n)
+{
+    for (size_t ix = 0; ix < n; ix++) {
+        hash ^= (uint16_t)coords[ix];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline int is_binary_header(const cells_header_t *header)
+{
+    return memcmp(header->magic, CELLS_MAGIC, 4) == 0;
+}
+
+#endif
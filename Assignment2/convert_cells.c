@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cells.h"
+
+/* Streaming converter from the text cells format to the binary one (see cells.h).
+Usage: convert_cells <text input> <binary output>
+The input is read in chunks of CHUNK_LINES lines, so memory use does not depend on the
+file size. The header is written first with zero count and checksum and rewritten at
+the end, so the output has to be a regular file.
+*/
+#define CHUNK_LINES 8192
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <text input> <binary output>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        fprintf(stderr, "error opening %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "error opening %s\n", argv[2]);
+        fclose(in);
+        return EXIT_FAILURE;
+    }
+
+    cells_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CELLS_MAGIC, 4);
+    header.version = CELLS_VERSION;
+    header.checksum = CHECKSUM_INIT;
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+        fprintf(stderr, "error writing %s\n", argv[2]);
+        fclose(in);
+        fclose(out);
+        return EXIT_FAILURE;
+    }
+
+    static char text[CHUNK_LINES * RECORD_SIZE];
+    static int16_t points[CHUNK_LINES * 3];
+    size_t bytes;
+    while ((bytes = fread(text, 1, sizeof(text), in)) > 0) {
+        // the last line may come without its newline
+        size_t lines = (bytes + 1) / RECORD_SIZE;
+        if (bytes % RECORD_SIZE != 0 && bytes % RECORD_SIZE != RECORD_SIZE - 1) {
+            fprintf(stderr, "malformed input, expected %d-byte lines\n", RECORD_SIZE);
+            fclose(in);
+            fclose(out);
+            return EXIT_FAILURE;
+        }
+        for (size_t line = 0; line < lines; line++) {
+            const char *record = text + line * RECORD_SIZE;
+            points[line * 3] = parse_coord(record);
+            points[line * 3 + 1] = parse_coord(record + 8);
+            points[line * 3 + 2] = parse_coord(record + 16);
+        }
+        if (fwrite(points, BINARY_RECORD_SIZE, lines, out) != lines) {
+            fprintf(stderr, "error writing %s\n", argv[2]);
+            fclose(in);
+            fclose(out);
+            return EXIT_FAILURE;
+        }
+        header.checksum = checksum_update(header.checksum, points, lines * 3);
+        header.num_points += lines;
+    }
+
+    // now the count and checksum are known
+    if (ferror(in) || fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1) {
+        fprintf(stderr, "error converting %s\n", argv[1]);
+        fclose(in);
+        fclose(out);
+        return EXIT_FAILURE;
+    }
+    fclose(in);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "error writing %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%lu points written to %s\n", header.num_points, argv[2]);
+    return EXIT_SUCCESS;
+}
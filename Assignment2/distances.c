@@ -7,161 +7,2875 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <immintrin.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
 
-// A GLOBAL VAR FOR USER DEFINE BATCH_SIZE
-/* We are allowed to use 5 MiB = 5 * 1024^2 bytes of memory.
-Through our implementation, Type SHORT is used to store our data and there are two blocks stored in the memory to calculate distances at the same time.
-As a result, we calculate the size of each block in the following way, 
-BATCH_SIZE = 5 * 1024^2 / (2 * 3 * 2)
-, where the first 2 is the size of SHORT, 3 means every point is three dimentional and the second 2 is the num of blocks.
-The result is around 436906.
-For simplicity and space for other variables, which is relatively small compared with the data, we take it as 400000.
+#include "cells.h"
+
+/* Memory budget.
+We are allowed to use 5 MiB = 5 * 1024^2 bytes of memory by default, -m<bytes> sets another
+budget for the job class at hand. Everything sizeable is accounted against it: mem_reserve
+books the static bin tables, the map window and the per-thread histograms (up to a share,
+see thread_hist_t), mem_alloc the blocks, and an allocation that would exceed the budget
+fails. The blocks come last and share what is left, see block_points.
+Type SHORT is used to store our data, so every point takes 3 * 2 bytes in a block. With the
+default budget and two blocks this gives about 400000 points per block, the value the
+fixed BATCH_SIZE used to be derived from by hand.
+*/
+#define DEFAULT_BUDGET (5 * 1024 * 1024)
+static size_t mem_budget = DEFAULT_BUDGET;
+static size_t mem_used = 0;
+
+int mem_reserve(size_t bytes)
+{
+    if (mem_used + bytes > mem_budget) {
+        return -1;
+    }
+    mem_used += bytes;
+    return 0;
+}
+
+void *mem_alloc(size_t bytes)
+{
+    bytes = (bytes + 63) / 64 * 64;
+    if (mem_reserve(bytes) != 0) {
+        return NULL;
+    }
+    void *ptr = aligned_alloc(64, bytes);
+    if (ptr == NULL) {
+        mem_used -= bytes;
+    }
+    return ptr;
+}
+
+void mem_free(void *ptr, size_t bytes)
+{
+    if (ptr != NULL) {
+        mem_used -= (bytes + 63) / 64 * 64;
+        free(ptr);
+    }
+}
+
+/* Size in bytes of the level 1 data or level 2 cache, from sysconf and otherwise from
+sysfs, 0 if neither knows it. */
+size_t cache_size(int level)
+{
+    long size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+    if (size > 0) {
+        return (size_t)size;
+    }
+    for (int index = 0; index < 8; index++) {
+        char path[64], buffer[32];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            break;
+        }
+        int found = fgets(buffer, sizeof(buffer), file) != NULL && atoi(buffer) == level;
+        fclose(file);
+        if (!found) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        found = fgets(buffer, sizeof(buffer), file) != NULL && strncmp(buffer, "Instruction", 11) != 0;
+        fclose(file);
+        if (!found) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        size_t kib = (fgets(buffer, sizeof(buffer), file) != NULL) ? strtoul(buffer, NULL, 10) : 0;
+        fclose(file);
+        return kib * 1024;
+    }
+    return 0;
+}
+
+/* The blocks can also be split into more, smaller ones: -k<blocks> keeps k blocks
+resident (see schedule_t) and -P adds one block for the loader thread. They all share
+the same remaining budget. */
+#define MAX_RESIDENT 64
+
+/* A block of points in structure-of-arrays order.
+x, y and z are separate 64-byte aligned arrays whose capacity is rounded up to a multiple
+of BLOCK_PAD points (the widest vector step of count_row), so the distance kernels stream
+three contiguous arrays instead of striding through (x, y, z) triplets.
+*/
+#define BLOCK_PAD 32
+
+typedef struct {
+    int16_t *x;
+    int16_t *y;
+    int16_t *z;
+    uint32_t *w;  // multiplicities, only allocated in the deduplicating mode (-d)
+    int weighted; // w holds the multiplicities of a deduplicated block
+    size_t len;
+    size_t loaded; // points read from the file, len is smaller after deduplication
+    size_t capacity;
+} block_t;
+
+int block_alloc(block_t *block, size_t capacity, int weights)
+{
+    capacity = (capacity + BLOCK_PAD - 1) / BLOCK_PAD * BLOCK_PAD;
+    block->x = (int16_t *)mem_alloc(capacity * sizeof(int16_t));
+    block->y = (int16_t *)mem_alloc(capacity * sizeof(int16_t));
+    block->z = (int16_t *)mem_alloc(capacity * sizeof(int16_t));
+    block->w = weights ? (uint32_t *)mem_alloc(capacity * sizeof(uint32_t)) : NULL;
+    block->weighted = 0;
+    block->len = 0;
+    block->loaded = 0;
+    block->capacity = capacity;
+    if (block->x == NULL || block->y == NULL || block->z == NULL || (weights && block->w == NULL)) {
+        return -1;
+    }
+    return 0;
+}
+
+void block_free(block_t *block)
+{
+    mem_free(block->x, block->capacity * sizeof(int16_t));
+    mem_free(block->y, block->capacity * sizeof(int16_t));
+    mem_free(block->z, block->capacity * sizeof(int16_t));
+    mem_free(block->w, block->capacity * sizeof(uint32_t));
+}
+
+/* Duplicate-point compression (-d).
+Coordinates are quantized to int16, and clustered data repeats points exactly. A loaded
+block is sorted by its packed (x, y, z) key and every run of equal points is collapsed
+into one point with its multiplicity in w, so the kernels visit each distinct pair of
+positions once and add w_i * w_j, which keeps the histogram exact.
+Weighted pairs take the scalar path, so when more than DEDUP_MAX_RATIO of the points are
+distinct the block keeps all its points unweighted instead: (u / n)^2 of the pairs at
+scalar speed only pays off against the vector kernels below about that ratio.
+dedup_scratch holds one key per point of a block; loads never overlap, so one is enough.
+*/
+#define DEDUP_MAX_RATIO 0.7
+static uint64_t *dedup_scratch = NULL;
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint64_t key_a = *(const uint64_t *)a, key_b = *(const uint64_t *)b;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+void dedup_block(block_t *block, uint64_t *keys)
+{
+    size_t len = block->len;
+    for (size_t ix = 0; ix < len; ix++) {
+        keys[ix] = ((uint64_t)(uint16_t)block->x[ix] << 32)
+            | ((uint64_t)(uint16_t)block->y[ix] << 16) | (uint16_t)block->z[ix];
+    }
+    qsort(keys, len, sizeof(uint64_t), compare_keys);
+
+    size_t unique = (len > 0) ? 1 : 0;
+    for (size_t ix = 1; ix < len; ix++) {
+        unique += keys[ix] != keys[ix - 1];
+    }
+    if (unique > DEDUP_MAX_RATIO * len) {
+        block->weighted = 0; // too few duplicates to pay off, keep the points as they are
+        return;
+    }
+
+    size_t out = 0;
+    for (size_t ix = 0; ix < len; ix++) {
+        if (ix > 0 && keys[ix] == keys[ix - 1]) {
+            block->w[out - 1]++;
+            continue;
+        }
+        block->x[out] = (int16_t)(keys[ix] >> 32);
+        block->y[out] = (int16_t)(keys[ix] >> 16);
+        block->z[out] = (int16_t)keys[ix];
+        block->w[out] = 1;
+        out++;
+    }
+    block->len = out;
+    block->weighted = 1;
+}
+
+/* The file is mapped in windows of MAP_WINDOW records (192 KiB of text) rather than as
+a whole, so the mapped pages fit into what the blocks leave of the 5 MiB budget. */
+#define MAP_WINDOW 8192
+
+/* An open cells file, text or binary (see cells.h). Points start at data_offset and
+take record_size bytes each. */
+typedef struct {
+    int fd;
+    int binary;
+    size_t file_size;
+    size_t num_points;
+    size_t data_offset;
+    size_t record_size;
+    uint64_t checksum; // from the binary header
+} cells_t;
+
+int cells_open(cells_t *cells, const char *filename)
+{
+    struct stat st;
+    cells_header_t header;
+    cells->fd = open(filename, O_RDONLY);
+    if (cells->fd < 0) {
+        return -1;
+    }
+    if (fstat(cells->fd, &st) != 0) {
+        close(cells->fd);
+        return -1;
+    }
+    cells->file_size = (size_t)st.st_size;
+    cells->binary = cells->file_size >= sizeof(header)
+        && pread(cells->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+        && is_binary_header(&header);
+
+    if (!cells->binary) {
+        cells->num_points = (cells->file_size + 1) / RECORD_SIZE;
+        cells->data_offset = 0;
+        cells->record_size = RECORD_SIZE;
+        return 0;
+    }
+    if (header.version != CELLS_VERSION
+        || cells->file_size != sizeof(header) + header.num_points * BINARY_RECORD_SIZE) {
+        close(cells->fd);
+        return -1;
+    }
+    cells->num_points = header.num_points;
+    cells->data_offset = sizeof(header);
+    cells->record_size = BINARY_RECORD_SIZE;
+    cells->checksum = header.checksum;
+    return 0;
+}
+
+void cells_close(cells_t *cells)
+{
+    close(cells->fd);
+}
+
+/* Phase timers for the JSON report (-j<file>).
+Only taken when the report is asked for, as one pair of omp_get_wtime calls around every
+load_batch, self_distance and double_distance call and nothing inside the kernels.
+The loads of the pipelined loader thread are timed in that thread, they never overlap
+another load.
+*/
+typedef struct {
+    size_t calls;
+    double seconds;
+    double max_seconds;
+    uint64_t amount; // bytes read for the loads, pairs for the kernels
+} phase_t;
+
+static int timing = 0;
+static phase_t phase_load, phase_self, phase_cross;
+
+static inline double phase_start(void)
+{
+    return timing ? omp_get_wtime() : 0.0;
+}
+
+static inline void phase_end(phase_t *phase, double start, uint64_t amount)
+{
+    if (timing) {
+        double seconds = omp_get_wtime() - start;
+        phase->calls++;
+        phase->seconds += seconds;
+        phase->max_seconds = (seconds > phase->max_seconds) ? seconds : phase->max_seconds;
+        phase->amount += amount;
+    }
+}
+
+/* Load the points [first, first + size) of the cells file into batch.
+Each window is decoded by all OpenMP threads, every record is independent because of
+the fixed layout. The loader thread of the pipelined mode passes parallel = 0 and
+decodes alone, the workers are busy with the distances meanwhile. */
+int load_batch(block_t *batch, size_t first, size_t size, const cells_t *cells, int parallel)
+{
+    double phase = phase_start();
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    int16_t *x = batch->x;
+    int16_t *y = batch->y;
+    int16_t *z = batch->z;
+
+    size_t record_size = cells->record_size;
+
+    for (size_t start = 0; start < size; start += MAP_WINDOW) {
+        size_t count = (size - start < MAP_WINDOW) ? size - start : MAP_WINDOW;
+        size_t begin = cells->data_offset + (first + start) * record_size;
+        size_t end = begin + count * record_size;
+        if (end > cells->file_size) {
+            end = cells->file_size;
+        }
+        size_t map_offset = begin / page_size * page_size;
+        size_t map_length = end - map_offset;
+
+        char *map = (char *)mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, cells->fd, (off_t)map_offset);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, map_length, MADV_SEQUENTIAL);
+        const char *records = map + (begin - map_offset);
+        int16_t *x_out = x + start, *y_out = y + start, *z_out = z + start;
+
+        if (cells->binary) {
+            // already int16, only the (x, y, z) triplets are split into the three arrays
+            for (size_t line = 0; line < count; line++) {
+                int16_t point[3];
+                memcpy(point, records + line * BINARY_RECORD_SIZE, sizeof(point));
+                x_out[line] = point[0];
+                y_out[line] = point[1];
+                z_out[line] = point[2];
+            }
+        } else {
+            #pragma omp parallel for if(parallel) \
+                default(none) shared(records, count, x_out, y_out, z_out)
+
+            for (size_t line = 0; line < count; line++) {
+                const char *record = records + line * RECORD_SIZE;
+                x_out[line] = parse_coord(record);
+                y_out[line] = parse_coord(record + 8);
+                z_out[line] = parse_coord(record + 16);
+            }
+        }
+
+        munmap(map, map_length);
+    }
+    batch->len = size;
+    batch->loaded = size;
+    batch->weighted = 0;
+    if (dedup_scratch != NULL) {
+        dedup_block(batch, dedup_scratch);
+    }
+    phase_end(&phase_load, phase, size * record_size);
+    return 0;
+}
+
+/* Continue the checksum of cells.h over the points [first, first + n), in either format,
+with one sequential pass. That is a single read of every point, small next to the batch
+loops, which read most blocks several times. The buffers are smaller than the map window
+and the two are never in use at the same time, so they live within the window's share
+of the budget. */
+#define CHECKSUM_CHUNK (MAP_WINDOW / 4)
+
+int cells_checksum(const cells_t *cells, size_t first, size_t n, uint64_t *hash)
+{
+    char text[CHECKSUM_CHUNK * RECORD_SIZE];
+    int16_t buffer[CHECKSUM_CHUNK * 3];
+    for (size_t start = 0; start < n; start += CHECKSUM_CHUNK) {
+        size_t count = (n - start < CHECKSUM_CHUNK) ? n - start : CHECKSUM_CHUNK;
+        size_t offset = cells->data_offset + (first + start) * cells->record_size;
+        size_t bytes = count * cells->record_size;
+        bytes = (offset + bytes > cells->file_size) ? cells->file_size - offset : bytes;
+        char *target = cells->binary ? (char *)buffer : text;
+        if (pread(cells->fd, target, bytes, (off_t)offset) != (ssize_t)bytes) {
+            return -1;
+        }
+        if (!cells->binary) {
+            for (size_t line = 0; line < count; line++) {
+                const char *record = text + line * RECORD_SIZE;
+                buffer[line * 3] = parse_coord(record);
+                buffer[line * 3 + 1] = parse_coord(record + 8);
+                buffer[line * 3 + 2] = parse_coord(record + 16);
+            }
+        }
+        *hash = checksum_update(*hash, buffer, count * 3);
+    }
+    return 0;
+}
+
+// check the checksum in the header of a binary cells file
+int cells_verify(const cells_t *cells)
+{
+    uint64_t hash = CHECKSUM_INIT;
+    if (cells_checksum(cells, 0, cells->num_points, &hash) != 0) {
+        return -1;
+    }
+    return (hash == cells->checksum) ? 0 : -1;
+}
+
+#define NUM_BINS 3465
+
+/* Largest possible squared distance: every coordinate lies in [-10000, 10000],
+so each of the three components contributes at most 20000^2. */
+#define MAX_SQ_DISTANCE (3 * 20000 * 20000)
+
+/* Squared-distance bin boundaries.
+bin_bound[b] is the smallest squared distance that calculate_distance maps to bin b,
+so a pair falls into bin b exactly when bin_bound[b] <= d2 < bin_bound[b + 1].
+The table is derived from calculate_distance itself, therefore the float rounding of the
+original sqrt path is reproduced bit for bit. bin_bound[NUM_BINS] is a sentinel.
+
+bin_hint is indexed by the exponent and the top HINT_MANTISSA_BITS mantissa bits of
+(float)(d2 + 1), i.e. buckets of relative width 2^-11. A bin is about 2/b wide relative
+to its d2, which is never below 2^-11 for b < 3465, so no bucket holds more than one
+boundary: the bin is bin_hint[key] or the one after it, one compare decides which.
+init_bin_tables checks this property. The extra entry keeps 32-bit gathers in bounds.
+*/
+#define HINT_MANTISSA_BITS 11
+#define HINT_SHIFT (23 - HINT_MANTISSA_BITS)
+#define HINT_BASE (0x3F800000 >> HINT_SHIFT) // float bits of 1.0f
+#define HINT_SIZE (31 << HINT_MANTISSA_BITS) // keys of every d2 + 1 < 2^31
+static int32_t bin_bound[NUM_BINS + 1];
+static uint16_t bin_hint[HINT_SIZE + 1];
+
+// reference mapping, only used to build the tables
+static inline int16_t calculate_distance(int32_t sq_distance)
+{
+    float temp = sqrt(sq_distance);
+    return (int16_t)(temp / 10);
+}
+
+static inline int32_t hint_index(int32_t d2)
+{
+    float f = (float)(d2 + 1);
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return (int32_t)(bits >> HINT_SHIFT) - HINT_BASE;
+}
+
+int init_bin_tables(void)
+{
+    for (int32_t bin = 0; bin < NUM_BINS; bin++) {
+        // smallest d2 with calculate_distance(d2) >= bin, the mapping is monotonic
+        int32_t lo = 0, hi = MAX_SQ_DISTANCE + 1;
+        while (lo < hi) {
+            int32_t mid = lo + (hi - lo) / 2;
+            if (calculate_distance(mid) >= bin) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        bin_bound[bin] = lo;
+        if (bin > 0 && hint_index(bin_bound[bin]) <= hint_index(bin_bound[bin - 1])) {
+            return -1;
+        }
+    }
+    bin_bound[NUM_BINS] = INT32_MAX;
+
+    // bin_hint[key] is the last bin whose lower boundary lies in an earlier bucket
+    int32_t bin = 0;
+    for (int32_t key = 0; key <= HINT_SIZE; key++) {
+        while (bin + 1 < NUM_BINS && hint_index(bin_bound[bin + 1]) < key) {
+            bin++;
+        }
+        bin_hint[key] = (uint16_t)bin;
+    }
+    return 0;
+}
+
+static inline int32_t distance_bin(int32_t d2)
+{
+    int32_t bin = bin_hint[hint_index(d2)];
+    return bin + (d2 >= bin_bound[bin + 1]);
+}
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+static inline __m512i distance_bin_512(__m512i d2)
+{
+    const __m512i one = _mm512_set1_epi32(1);
+    __m512i key = _mm512_sub_epi32(_mm512_srli_epi32(_mm512_castps_si512(
+        _mm512_cvtepi32_ps(_mm512_add_epi32(d2, one))), HINT_SHIFT), _mm512_set1_epi32(HINT_BASE));
+    __m512i bin = _mm512_and_si512(_mm512_i32gather_epi32(key, bin_hint, 2), _mm512_set1_epi32(0xFFFF));
+    __m512i next = _mm512_i32gather_epi32(_mm512_add_epi32(bin, one), bin_bound, 4);
+    return _mm512_mask_add_epi32(bin, _mm512_cmpge_epi32_mask(d2, next), bin, one);
+}
+#elif defined(__AVX2__)
+static inline __m256i distance_bin_256(__m256i d2)
+{
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256i key = _mm256_sub_epi32(_mm256_srli_epi32(_mm256_castps_si256(
+        _mm256_cvtepi32_ps(_mm256_add_epi32(d2, one))), HINT_SHIFT), _mm256_set1_epi32(HINT_BASE));
+    __m256i bin = _mm256_and_si256(_mm256_i32gather_epi32((const int *)bin_hint, key, 2), _mm256_set1_epi32(0xFFFF));
+    __m256i next = _mm256_i32gather_epi32(bin_bound, _mm256_add_epi32(bin, one), 4);
+    // cmpgt is all ones (-1) where d2 >= next
+    return _mm256_sub_epi32(bin, _mm256_cmpgt_epi32(_mm256_add_epi32(d2, one), next));
+}
+#endif
+
+/* Per-thread histograms.
+Every thread owns one thread_hist_t for the whole run, so there is no reduction array
+to allocate, zero and combine per kernel call. Within a thread, HIST_COPIES interleaved
+16-bit sub-histograms (bin b of copy c at sub[b * HIST_COPIES + c]) take consecutive
+increments in turn, so pairs that land in the same bin do not wait on each other's store.
+A flush adds the sub-histograms into the 64-bit totals after at most HIST_LIMIT
+increments, before any counter can wrap, and the totals of all threads are merged once
+at the end. The 16-bit counters keep a histogram at about 42 KB, the sub-histograms
+in L1 next to the column tile; a flush costs little next to the 65535 pairs before it.
+*/
+#define HIST_COPIES 2
+#define HIST_LIMIT UINT16_MAX
+
+typedef struct {
+    uint16_t sub[NUM_BINS * HIST_COPIES];
+    uint64_t total[NUM_BINS];
+    size_t pending; // increments since the last flush, bounds every sub counter
+    // work done by the thread, for the -p report
+    uint64_t self_pairs;
+    uint64_t cross_pairs;
+    double self_seconds;
+    double cross_seconds;
+} __attribute__((aligned(64))) thread_hist_t;
+
+thread_hist_t *hist_alloc(int n_threads)
+{
+    if (mem_reserve(n_threads * sizeof(thread_hist_t)) != 0) {
+        return NULL;
+    }
+    thread_hist_t *hists = (thread_hist_t *)aligned_alloc(64, n_threads * sizeof(thread_hist_t));
+    if (hists == NULL) {
+        mem_used -= n_threads * sizeof(thread_hist_t);
+        return NULL;
+    }
+    memset(hists, 0, n_threads * sizeof(thread_hist_t));
+    return hists;
+}
+
+void hist_free(thread_hist_t *hists, int n_threads)
+{
+    mem_used -= n_threads * sizeof(thread_hist_t);
+    free(hists);
+}
+
+static void hist_flush(thread_hist_t *hist)
+{
+    for (size_t bin = 0; bin < NUM_BINS; bin++) {
+        uint16_t *sub = hist->sub + bin * HIST_COPIES;
+        for (size_t copy = 0; copy < HIST_COPIES; copy++) {
+            hist->total[bin] += sub[copy];
+            sub[copy] = 0;
+        }
+    }
+    hist->pending = 0;
+}
+
+// make room for n <= HIST_LIMIT more increments
+static inline void hist_reserve(thread_hist_t *hist, size_t n)
+{
+    if (hist->pending + n > HIST_LIMIT) {
+        hist_flush(hist);
+    }
+    hist->pending += n;
+}
+
+void hist_merge(thread_hist_t *hists, int n_threads, size_t *count)
+{
+    for (int thread = 0; thread < n_threads; thread++) {
+        hist_flush(&hists[thread]);
+        for (size_t bin = 0; bin < NUM_BINS; bin++) {
+            count[bin] += hists[thread].total[bin];
+        }
+    }
+}
+
+/* Count the distances from the point (px, py, pz) to n consecutive points of the
+x, y and z arrays.
+The vector paths load 32 (AVX-512) or 16 (AVX2) coordinates of each array, subtract in
+16-bit lanes and interleave (dx, dy) and (dz, 0) so that madd yields the squared distances
+as 32-bit lanes. The interleaving permutes the points, which does not matter for a
+histogram. The remaining points go through the scalar path, which produces the same bins.
+Increments are spread over the HIST_COPIES sub-histograms of the calling thread, in
+spans of at most HIST_SPAN points so that one flush check covers a whole span.
+*/
+#define HIST_SPAN (HIST_LIMIT / BLOCK_PAD * BLOCK_PAD)
+
+static inline void count_span(int16_t px, int16_t py, int16_t pz,
+    const int16_t *x, const int16_t *y, const int16_t *z, size_t n, thread_hist_t *hist)
+{
+    size_t jx = 0;
+    uint16_t *sub = hist->sub;
+    hist_reserve(hist, n);
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+    const __m512i p_x = _mm512_set1_epi16(px);
+    const __m512i p_y = _mm512_set1_epi16(py);
+    const __m512i p_z = _mm512_set1_epi16(pz);
+    const __m512i zero = _mm512_setzero_si512();
+    int32_t bins[32] __attribute__((aligned(64)));
+
+    for (; jx + 32 <= n; jx += 32) {
+        __m512i dx = _mm512_sub_epi16(p_x, _mm512_loadu_si512(x + jx));
+        __m512i dy = _mm512_sub_epi16(p_y, _mm512_loadu_si512(y + jx));
+        __m512i dz = _mm512_sub_epi16(p_z, _mm512_loadu_si512(z + jx));
+        __m512i xy_lo = _mm512_unpacklo_epi16(dx, dy);
+        __m512i xy_hi = _mm512_unpackhi_epi16(dx, dy);
+        __m512i z_lo = _mm512_unpacklo_epi16(dz, zero);
+        __m512i z_hi = _mm512_unpackhi_epi16(dz, zero);
+        __m512i d2_lo = _mm512_add_epi32(_mm512_madd_epi16(xy_lo, xy_lo), _mm512_madd_epi16(z_lo, z_lo));
+        __m512i d2_hi = _mm512_add_epi32(_mm512_madd_epi16(xy_hi, xy_hi), _mm512_madd_epi16(z_hi, z_hi));
+
+        _mm512_store_si512((__m512i *)bins, distance_bin_512(d2_lo));
+        _mm512_store_si512((__m512i *)(bins + 16), distance_bin_512(d2_hi));
+        for (int lane = 0; lane < 32; lane++) {
+            sub[bins[lane] * HIST_COPIES + lane % HIST_COPIES] += 1;
+        }
+    }
+#elif defined(__AVX2__)
+    const __m256i p_x = _mm256_set1_epi16(px);
+    const __m256i p_y = _mm256_set1_epi16(py);
+    const __m256i p_z = _mm256_set1_epi16(pz);
+    const __m256i zero = _mm256_setzero_si256();
+    int32_t bins[16] __attribute__((aligned(32)));
+
+    for (; jx + 16 <= n; jx += 16) {
+        __m256i dx = _mm256_sub_epi16(p_x, _mm256_loadu_si256((const __m256i *)(x + jx)));
+        __m256i dy = _mm256_sub_epi16(p_y, _mm256_loadu_si256((const __m256i *)(y + jx)));
+        __m256i dz = _mm256_sub_epi16(p_z, _mm256_loadu_si256((const __m256i *)(z + jx)));
+        __m256i xy_lo = _mm256_unpacklo_epi16(dx, dy);
+        __m256i xy_hi = _mm256_unpackhi_epi16(dx, dy);
+        __m256i z_lo = _mm256_unpacklo_epi16(dz, zero);
+        __m256i z_hi = _mm256_unpackhi_epi16(dz, zero);
+        __m256i d2_lo = _mm256_add_epi32(_mm256_madd_epi16(xy_lo, xy_lo), _mm256_madd_epi16(z_lo, z_lo));
+        __m256i d2_hi = _mm256_add_epi32(_mm256_madd_epi16(xy_hi, xy_hi), _mm256_madd_epi16(z_hi, z_hi));
+
+        _mm256_store_si256((__m256i *)bins, distance_bin_256(d2_lo));
+        _mm256_store_si256((__m256i *)(bins + 8), distance_bin_256(d2_hi));
+        for (int lane = 0; lane < 16; lane++) {
+            sub[bins[lane] * HIST_COPIES + lane % HIST_COPIES] += 1;
+        }
+    }
+#endif
+    // squared distances in chunks first, so the compiler vectorizes them apart from the lookups
+    int32_t d2[16];
+    while (jx < n) {
+        size_t chunk = (n - jx < 16) ? n - jx : 16;
+        for (size_t kx = 0; kx < chunk; kx++) {
+            int32_t dx = px - x[jx + kx];
+            int32_t dy = py - y[jx + kx];
+            int32_t dz = pz - z[jx + kx];
+            d2[kx] = dx * dx + dy * dy + dz * dz;
+        }
+        for (size_t kx = 0; kx < chunk; kx++) {
+            sub[distance_bin(d2[kx]) * HIST_COPIES + kx % HIST_COPIES] += 1;
+        }
+        jx += chunk;
+    }
+}
+
+static inline void count_row(int16_t px, int16_t py, int16_t pz,
+    const int16_t *x, const int16_t *y, const int16_t *z, size_t n, thread_hist_t *hist)
+{
+    for (size_t jx = 0; jx < n; jx += HIST_SPAN) {
+        size_t span = (n - jx < HIST_SPAN) ? n - jx : HIST_SPAN;
+        count_span(px, py, pz, x + jx, y + jx, z + jx, span, hist);
+    }
+}
+
+/* count_row for pairs with deduplicated blocks: the pair of the point (weight pw) with
+point j counts pw * w[j] times, w == NULL stands for weight 1. The products go straight
+into the 64-bit totals of the thread. */
+static inline void count_row_weighted(int16_t px, int16_t py, int16_t pz, uint64_t pw,
+    const int16_t *x, const int16_t *y, const int16_t *z, const uint32_t *w, size_t n, thread_hist_t *hist)
+{
+    uint64_t *total = hist->total;
+    int32_t d2[16];
+    for (size_t jx = 0; jx < n; jx += 16) {
+        size_t chunk = (n - jx < 16) ? n - jx : 16;
+        for (size_t kx = 0; kx < chunk; kx++) {
+            int32_t dx = px - x[jx + kx];
+            int32_t dy = py - y[jx + kx];
+            int32_t dz = pz - z[jx + kx];
+            d2[kx] = dx * dx + dy * dy + dz * dz;
+        }
+        for (size_t kx = 0; kx < chunk; kx++) {
+            total[distance_bin(d2[kx])] += pw * ((w != NULL) ? w[jx + kx] : 1);
+        }
+    }
+}
+
+/* Tile sizes of the blocked traversal, in points.
+tile_rows points of one block are run against tile_cols points of the other, so the
+column tile (6 bytes per point) stays in L1 next to the histogram while it is reused by
+every row of the row tile, and the row tile stays in L2. tile_rows == 0 selects the
+plain row-by-row loop nest. Both are set with -T<rows>x<cols>.
+*/
+static size_t tile_rows = 256;
+static size_t tile_cols = 1024;
+
+static inline void count_tile(const block_t *rows, size_t r0, size_t r1,
+    const block_t *cols, size_t c0, size_t c1, thread_hist_t *hist)
+{
+    if (rows->weighted || cols->weighted) {
+        const uint32_t *w = cols->weighted ? cols->w + c0 : NULL;
+        for (size_t ix = r0; ix < r1; ix++) {
+            count_row_weighted(rows->x[ix], rows->y[ix], rows->z[ix], rows->weighted ? rows->w[ix] : 1,
+                cols->x + c0, cols->y + c0, cols->z + c0, w, c1 - c0, hist);
+        }
+        return;
+    }
+    for (size_t ix = r0; ix < r1; ix++) {
+        count_row(rows->x[ix], rows->y[ix], rows->z[ix],
+            cols->x + c0, cols->y + c0, cols->z + c0, c1 - c0, hist);
+    }
+}
+
+// pairs of the rows [0, row) in the triangle of a block of len points
+static inline size_t triangle_pairs(size_t row, size_t len)
+{
+    return (row == 0) ? 0 : row * (len - 1) - row * (row - 1) / 2;
+}
+
+/* First row of part `part` when the rows [first, last) of the triangle of a block of len
+points are split into `parts` row ranges with equal pair counts. Row r pairs with the
+len - 1 - r points after it, so equal row counts would give the first threads far more
+work than the last.
+*/
+static size_t triangle_split(size_t part, size_t parts, size_t first, size_t last, size_t len)
+{
+    size_t base = triangle_pairs(first, len);
+    size_t target = base + (size_t)((double)(triangle_pairs(last, len) - base) * part / parts);
+    size_t lo = first, hi = last;
+    if (part == parts) {
+        return last;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (triangle_pairs(mid, len) >= target) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* The pairs of the rows [first, last) of the triangle of batch, each row with the points
+after it. A split by rows is what lets MPI ranks share one block (run_schedule_share). */
+void self_distance_rows(const block_t *batch, size_t first, size_t last, thread_hist_t *hists)
+{
+    double phase = phase_start();
+    size_t len = batch->len;
+    size_t t_rows = tile_rows, t_cols = tile_cols;
+
+    // the w * (w - 1) / 2 pairs among copies of the same point are at distance 0
+    if (batch->weighted) {
+        for (size_t ix = first; ix < last; ix++) {
+            hists[0].total[distance_bin(0)] += (uint64_t)batch->w[ix] * (batch->w[ix] - 1) / 2;
+        }
+    }
+
+    /* Every thread takes one row range of equal pair count. With tiling, row tile [r0, r1)
+    of the range first covers the triangle inside itself, then runs against the column
+    tiles to its right. */
+    #pragma omp parallel \
+        default(none) shared(batch, first, last, len, t_rows, t_cols, hists)
+    {
+        int thread = omp_get_thread_num();
+        int n_threads = omp_get_num_threads();
+        thread_hist_t *hist = &hists[thread];
+        size_t begin = triangle_split(thread, n_threads, first, last, len);
+        size_t end = triangle_split(thread + 1, n_threads, first, last, len);
+        double start = omp_get_wtime();
+
+        if (t_rows == 0) {
+            for (size_t ix = begin; ix < end; ix++) {
+                count_tile(batch, ix, ix + 1, batch, ix + 1, len, hist);
+            }
+        } else {
+            for (size_t r0 = begin; r0 < end; r0 += t_rows) {
+                size_t r1 = (r0 + t_rows < end) ? r0 + t_rows : end;
+                for (size_t jx = r0; jx < r1; jx++) {
+                    count_tile(batch, jx, jx + 1, batch, jx + 1, r1, hist);
+                }
+                for (size_t c0 = r1; c0 < len; c0 += t_cols) {
+                    size_t c1 = (c0 + t_cols < len) ? c0 + t_cols : len;
+                    count_tile(batch, r0, r1, batch, c0, c1, hist);
+                }
+            }
+        }
+
+        hist->self_seconds += omp_get_wtime() - start;
+        hist->self_pairs += triangle_pairs(end, len) - triangle_pairs(begin, len);
+    }
+    phase_end(&phase_self, phase, triangle_pairs(last, len) - triangle_pairs(first, len));
+}
+
+void self_distance(const block_t *batch, thread_hist_t *hists)
+{
+    self_distance_rows(batch, 0, batch->len, hists);
+}
+
+// the pairs of the rows [first, last) of batch_1 with all of batch_2
+void double_distance_rows(const block_t *batch_1, size_t first, size_t last, const block_t *batch_2,
+    thread_hist_t *hists)
+{
+    double phase = phase_start();
+    size_t ix;
+    size_t len_2 = batch_2->len;
+
+    if (tile_rows == 0) {
+        #pragma omp parallel \
+            default(none) private(ix) \
+            shared(batch_1, batch_2, first, last, len_2, hists)
+        {
+            thread_hist_t *hist = &hists[omp_get_thread_num()];
+            double start = omp_get_wtime();
+
+            #pragma omp for nowait
+            for (ix = first; ix < last; ix++) {
+                count_tile(batch_1, ix, ix + 1, batch_2, 0, len_2, hist);
+                hist->cross_pairs += len_2;
+            }
+            hist->cross_seconds += omp_get_wtime() - start;
+        }
+        phase_end(&phase_cross, phase, (last - first) * len_2);
+        return;
+    }
+
+    size_t t_rows = tile_rows, t_cols = tile_cols;
+    size_t n_tiles = (last - first + t_rows - 1) / t_rows;
+
+    #pragma omp parallel \
+        default(none) private(ix) \
+        shared(batch_1, batch_2, first, last, len_2, n_tiles, t_rows, t_cols, hists)
+    {
+        thread_hist_t *hist = &hists[omp_get_thread_num()];
+        double start = omp_get_wtime();
+
+        #pragma omp for schedule(dynamic) nowait
+        for (ix = 0; ix < n_tiles; ix++) {
+            size_t r0 = first + ix * t_rows;
+            size_t r1 = (r0 + t_rows < last) ? r0 + t_rows : last;
+            for (size_t c0 = 0; c0 < len_2; c0 += t_cols) {
+                size_t c1 = (c0 + t_cols < len_2) ? c0 + t_cols : len_2;
+                count_tile(batch_1, r0, r1, batch_2, c0, c1, hist);
+            }
+            hist->cross_pairs += (r1 - r0) * len_2;
+        }
+        hist->cross_seconds += omp_get_wtime() - start;
+    }
+    phase_end(&phase_cross, phase, (last - first) * len_2);
+}
+
+void double_distance(const block_t *batch_1, const block_t *batch_2, thread_hist_t *hists)
+{
+    double_distance_rows(batch_1, 0, batch_1->len, batch_2, hists);
+}
+
+// number of points in batch index of a file with line_num points
+static inline size_t batch_len(size_t index, size_t batch_size, size_t line_num)
+{
+    size_t first = index * batch_size;
+    return (line_num - first < batch_size) ? line_num - first : batch_size;
+}
+
+/* Background load of one block for the pipelined mode. */
+typedef struct {
+    pthread_t thread;
+    const cells_t *cells;
+    block_t *block;
+    size_t first;
+    size_t size;
+    int error;
+    double seconds; // time spent loading
+} prefetch_t;
+
+static void *prefetch_thread(void *arg)
+{
+    prefetch_t *prefetch = (prefetch_t *)arg;
+    double start = omp_get_wtime();
+    prefetch->error = load_batch(prefetch->block, prefetch->first, prefetch->size, prefetch->cells, 0);
+    prefetch->seconds = omp_get_wtime() - start;
+    return NULL;
+}
+
+int prefetch_start(prefetch_t *prefetch, const cells_t *cells, block_t *block, size_t first, size_t size)
+{
+    prefetch->cells = cells;
+    prefetch->block = block;
+    prefetch->first = first;
+    prefetch->size = size;
+    prefetch->error = 0;
+    prefetch->seconds = 0.0;
+    return pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch);
+}
+
+int prefetch_wait(prefetch_t *prefetch)
+{
+    pthread_join(prefetch->thread, NULL);
+    return prefetch->error;
+}
+
+/* Block schedule.
+The naive loop reloads every later block for each outer block, so the bytes read grow
+with batch_num^2. The schedule instead keeps a group of resident - 1 blocks in slots,
+computes all pairs inside the group, and streams every later block through the last
+slot against the whole group. The stream runs from the last block down, so the block
+left in the stream slot is the first block of the next group and needs no reload.
+With 2 resident blocks this is the snake order of outer/inner blocks. Larger groups
+divide the number of streamed loads by resident - 1 for the same memory, as the blocks
+shrink accordingly.
+The schedule is generated one operation at a time, so its memory does not grow with the
+number of blocks.
+*/
+enum { OP_LOAD, OP_PAIR, OP_DONE };
+
+typedef struct {
+    int kind;
+    size_t block; // OP_LOAD: block index to load
+    int slot;     // OP_LOAD: target slot, OP_PAIR: first slot
+    int other;    // OP_PAIR: second slot, equal to slot for the self pairs of a block
+} schedule_op_t;
+
+enum { PHASE_LOAD, PHASE_GROUP, PHASE_STREAM };
+
+typedef struct {
+    size_t n_blocks;
+    int resident;
+    size_t group_start, group_end;
+    int phase;
+    int member, other;   // positions inside the group
+    size_t stream;       // block in the stream slot while streaming
+    int stream_slot;
+    int slot_of[MAX_RESIDENT];
+    long held[MAX_RESIDENT]; // block held by each slot, -1 if none
+} schedule_t;
+
+void schedule_init(schedule_t *sched, size_t n_blocks, int resident)
+{
+    sched->n_blocks = n_blocks;
+    sched->resident = resident;
+    sched->group_start = 0;
+    sched->group_end = (n_blocks < (size_t)resident - 1) ? n_blocks : (size_t)resident - 1;
+    sched->phase = PHASE_LOAD;
+    sched->member = 0;
+    for (int slot = 0; slot < resident; slot++) {
+        sched->held[slot] = -1;
+    }
+}
+
+static inline int schedule_in_group(const schedule_t *sched, long block)
+{
+    return block >= (long)sched->group_start && block < (long)sched->group_end;
+}
+
+// a slot that holds no block of the current group
+static inline int schedule_free_slot(const schedule_t *sched)
+{
+    int slot = 0;
+    while (schedule_in_group(sched, sched->held[slot])) {
+        slot++;
+    }
+    return slot;
+}
+
+schedule_op_t schedule_next(schedule_t *sched)
+{
+    schedule_op_t op = {OP_DONE, 0, 0, 0};
+    int size = (int)(sched->group_end - sched->group_start);
+
+    for (;;) {
+        if (sched->group_start >= sched->n_blocks) {
+            return op;
+        }
+        if (sched->phase == PHASE_LOAD) {
+            if (sched->member == size) {
+                sched->phase = PHASE_GROUP;
+                sched->member = 0;
+                sched->other = 0;
+                continue;
+            }
+            long block = (long)(sched->group_start + sched->member);
+            int slot = -1;
+            for (int ix = 0; ix < sched->resident; ix++) {
+                if (sched->held[ix] == block) {
+                    slot = ix;
+                }
+            }
+            if (slot >= 0) {
+                // still resident from the previous stream
+                sched->slot_of[sched->member++] = slot;
+                continue;
+            }
+            slot = schedule_free_slot(sched);
+            sched->slot_of[sched->member++] = slot;
+            sched->held[slot] = block;
+            op.kind = OP_LOAD;
+            op.block = (size_t)block;
+            op.slot = slot;
+            return op;
+        }
+        if (sched->phase == PHASE_GROUP) {
+            if (sched->member == size) {
+                sched->phase = PHASE_STREAM;
+                sched->member = size; // no pairs pending for a stream block yet
+                sched->stream = sched->n_blocks;
+                sched->stream_slot = schedule_free_slot(sched);
+                continue;
+            }
+            op.kind = OP_PAIR;
+            op.slot = sched->slot_of[sched->member];
+            op.other = sched->slot_of[sched->other];
+            if (++sched->other == size) {
+                sched->member++;
+                sched->other = sched->member;
+            }
+            return op;
+        }
+        // PHASE_STREAM
+        if (sched->member < size) {
+            op.kind = OP_PAIR;
+            op.slot = sched->slot_of[sched->member++];
+            op.other = sched->stream_slot;
+            return op;
+        }
+        if (sched->stream == sched->group_end || sched->group_end == sched->n_blocks) {
+            // next group
+            sched->group_start = sched->group_end;
+            sched->group_end += (size_t)sched->resident - 1;
+            if (sched->group_end > sched->n_blocks) {
+                sched->group_end = sched->n_blocks;
+            }
+            size = (int)(sched->group_end - sched->group_start);
+            sched->phase = PHASE_LOAD;
+            sched->member = 0;
+            continue;
+        }
+        sched->stream--;
+        sched->member = 0;
+        if (sched->held[sched->stream_slot] != (long)sched->stream) {
+            sched->held[sched->stream_slot] = (long)sched->stream;
+            op.kind = OP_LOAD;
+            op.block = sched->stream;
+            op.slot = sched->stream_slot;
+            return op;
+        }
+    }
+}
+
+/* Run the block schedule.
+buffers holds resident blocks, plus one spare for the loader thread when pipelined.
+slot_map maps schedule slots to buffers. When pipelined, the next load of the schedule
+goes into the spare buffer while the workers process the current pair, and then the
+buffers of that slot and the spare trade places, so the slot being replaced can still
+be in use during the load.
+load_seconds is the total loading time, wait_seconds the part the workers waited for;
+the difference was hidden behind the computation.
+*/
+typedef struct {
+    size_t loads;
+    size_t bytes_read;
+    size_t points_loaded;
+    size_t points_kept; // after deduplication
+    double load_seconds;
+    double wait_seconds;
+} run_stats_t;
+
+int run_schedule(const cells_t *cells, size_t batch_size, int resident, int pipelined,
+    block_t *buffers, thread_hist_t *hists, run_stats_t *stats)
+{
+    size_t line_num = cells->num_points;
+    size_t batch_num = (line_num + batch_size - 1) / batch_size;
+    int slot_map[MAX_RESIDENT];
+    int spare = resident;
+    int in_flight = 0;
+    prefetch_t prefetch;
+    schedule_t sched;
+
+    for (int slot = 0; slot < resident; slot++) {
+        slot_map[slot] = slot;
+    }
+    memset(stats, 0, sizeof(*stats));
+    schedule_init(&sched, batch_num, resident);
+
+    schedule_op_t op = schedule_next(&sched);
+    while (op.kind != OP_DONE) {
+        if (op.kind == OP_LOAD) {
+            size_t size = batch_len(op.block, batch_size, line_num);
+            double start = omp_get_wtime();
+            if (in_flight) {
+                in_flight = 0;
+                if (prefetch_wait(&prefetch) != 0) {
+                    return -1;
+                }
+                stats->load_seconds += prefetch.seconds;
+                int filled = spare;
+                spare = slot_map[op.slot];
+                slot_map[op.slot] = filled;
+            } else {
+                if (load_batch(&buffers[slot_map[op.slot]], op.block * batch_size, size, cells, 1) != 0) {
+                    return -1;
+                }
+                stats->load_seconds += omp_get_wtime() - start;
+            }
+            stats->wait_seconds += omp_get_wtime() - start;
+            stats->loads++;
+            stats->bytes_read += size * cells->record_size;
+            stats->points_loaded += buffers[slot_map[op.slot]].loaded;
+            stats->points_kept += buffers[slot_map[op.slot]].len;
+            op = schedule_next(&sched);
+            continue;
+        }
+
+        schedule_op_t next = schedule_next(&sched);
+        if (pipelined && next.kind == OP_LOAD) {
+            if (prefetch_start(&prefetch, cells, &buffers[spare], next.block * batch_size,
+                    batch_len(next.block, batch_size, line_num)) != 0) {
+                return -1;
+            }
+            in_flight = 1;
+        }
+
+        if (op.slot == op.other) {
+            self_distance(&buffers[slot_map[op.slot]], hists);
+        } else {
+            double_distance(&buffers[slot_map[op.slot]], &buffers[slot_map[op.other]], hists);
+        }
+        op = next;
+    }
+    return 0;
+}
+
+#ifdef USE_MPI
+/* Distributed run (the MPI build, distances_mpi).
+Every rank walks the same block schedule but only computes its share of the pairs: the
+pair operations are cut into ranges of equal point-pair work, in schedule order, so a
+rank gets a run of neighbouring pairs and reuses its blocks the way the whole schedule
+does. A range boundary inside a pair operation splits it by rows (share_row), the way
+triangle_split splits a block among threads, so a few large blocks still balance over
+many ranks. A block is only loaded when a pair of the share needs it, so every rank reads
+the blocks of its own pairs and no others. The histograms are summed by one MPI_Reduce.
+*/
+static size_t pair_work(const long *held, schedule_op_t op, size_t batch_size, size_t line_num)
+{
+    size_t len_1 = batch_len(held[op.slot], batch_size, line_num);
+    size_t len_2 = batch_len(held[op.other], batch_size, line_num);
+    return (op.slot == op.other) ? len_1 * (len_1 - 1) / 2 : len_1 * len_2;
+}
+
+/* Row of the first block of a pair operation at which the work position cut falls, for
+an operation of `work` starting at done. The neighbouring ranks compute the same row from
+the same cut, so every row is counted by exactly one of them. A self pair is cut by
+triangle pairs, a cross pair by rows.
+*/
+static size_t share_row(int self, size_t cut, size_t done, size_t work, size_t len)
+{
+    if (cut <= done) {
+        return 0;
+    }
+    if (cut >= done + work) {
+        return len;
+    }
+    unsigned __int128 part = cut - done;
+    if (!self) {
+        return (size_t)((part * len + work - 1) / work);
+    }
+    unsigned __int128 whole = triangle_pairs(len, len);
+    size_t lo = 0, hi = len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((unsigned __int128)triangle_pairs(mid, len) * work >= part * whole) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+int run_schedule_share(const cells_t *cells, size_t batch_size, int resident, block_t *buffers,
+    thread_hist_t *hists, run_stats_t *stats, int rank, int ranks)
+{
+    size_t line_num = cells->num_points;
+    size_t batch_num = (line_num + batch_size - 1) / batch_size;
+    long held[MAX_RESIDENT];   // block each slot holds in the schedule
+    long loaded[MAX_RESIDENT]; // block actually in each buffer
+    schedule_t sched;
+
+    // total work first, the schedule is cheap to generate twice
+    size_t total = 0;
+    schedule_init(&sched, batch_num, resident);
+    for (schedule_op_t op = schedule_next(&sched); op.kind != OP_DONE; op = schedule_next(&sched)) {
+        if (op.kind == OP_LOAD) {
+            held[op.slot] = (long)op.block;
+        } else {
+            total += pair_work(held, op, batch_size, line_num);
+        }
+    }
+    size_t begin = (size_t)((unsigned __int128)total * rank / ranks);
+    size_t end = (size_t)((unsigned __int128)total * (rank + 1) / ranks);
+
+    // a pair operation goes to every rank whose range overlaps its work
+    size_t done = 0;
+    memset(stats, 0, sizeof(*stats));
+    for (int slot = 0; slot < resident; slot++) {
+        loaded[slot] = -1;
+    }
+    schedule_init(&sched, batch_num, resident);
+    for (schedule_op_t op = schedule_next(&sched); op.kind != OP_DONE; op = schedule_next(&sched)) {
+        if (op.kind == OP_LOAD) {
+            held[op.slot] = (long)op.block;
+            continue;
+        }
+        size_t work = pair_work(held, op, batch_size, line_num);
+        if (done < end && done + work > begin) {
+            int slots[2] = {op.slot, op.other};
+            for (int ix = 0; ix < 2; ix++) {
+                int slot = slots[ix];
+                if (loaded[slot] == held[slot]) {
+                    continue;
+                }
+                size_t size = batch_len(held[slot], batch_size, line_num);
+                double start = omp_get_wtime();
+                if (load_batch(&buffers[slot], held[slot] * batch_size, size, cells, 1) != 0) {
+                    return -1;
+                }
+                stats->load_seconds += omp_get_wtime() - start;
+                stats->wait_seconds += omp_get_wtime() - start;
+                stats->loads++;
+                stats->bytes_read += size * cells->record_size;
+                stats->points_loaded += buffers[slot].loaded;
+                stats->points_kept += buffers[slot].len;
+                loaded[slot] = held[slot];
+            }
+            int self = (op.slot == op.other);
+            size_t len = buffers[op.slot].len;
+            size_t first = share_row(self, begin, done, work, len);
+            size_t last = share_row(self, end, done, work, len);
+            if (self) {
+                self_distance_rows(&buffers[op.slot], first, last, hists);
+            } else {
+                double_distance_rows(&buffers[op.slot], first, last, &buffers[op.other], hists);
+            }
+        }
+        done += work;
+    }
+    return 0;
+}
+#endif
+
+// bytes the original outer/inner loop with two blocks of batch_size points reads
+size_t naive_bytes_read(const cells_t *cells, size_t batch_size)
+{
+    size_t line_num = cells->num_points;
+    size_t batch_num = (line_num + batch_size - 1) / batch_size;
+    size_t bytes = 0;
+    for (size_t ix = 0; ix < batch_num; ix++) {
+        // once as outer block, and once as inner block for each earlier outer block
+        bytes += batch_len(ix, batch_size, line_num) * (ix + 1);
+    }
+    return bytes * cells->record_size;
+}
+
+/* Bipartite run (-b<file>): only the pairs between the points of two files.
+The file with fewer blocks is taken in groups of resident - 1 blocks, and every block of
+the other file streams through the last slot against the whole group. The streams
+alternate in direction, so the block left in the stream slot after one group is the
+first one the next group needs. With -P the next stream block loads into the spare
+buffer while the current one is processed, as in run_schedule.
+*/
+int run_bipartite(const cells_t *group_cells, const cells_t *stream_cells, size_t batch_size,
+    int resident, int pipelined, block_t *buffers, thread_hist_t *hists, run_stats_t *stats)
+{
+    size_t group_blocks = (group_cells->num_points + batch_size - 1) / batch_size;
+    size_t stream_blocks = (stream_cells->num_points + batch_size - 1) / batch_size;
+    size_t group_size = resident - 1;
+    int stream_buffer = resident - 1;
+    int spare = resident;
+    long held = -1; // stream block in the stream buffer
+    int in_flight = 0;
+    prefetch_t prefetch;
+
+    memset(stats, 0, sizeof(*stats));
+    for (size_t g0 = 0, pass = 0; g0 < group_blocks; g0 += group_size, pass++) {
+        size_t g1 = (g0 + group_size < group_blocks) ? g0 + group_size : group_blocks;
+        for (size_t ix = g0; ix < g1; ix++) {
+            size_t size = batch_len(ix, batch_size, group_cells->num_points);
+            double start = omp_get_wtime();
+            if (load_batch(&buffers[ix - g0], ix * batch_size, size, group_cells, 1) != 0) {
+                return -1;
+            }
+            stats->load_seconds += omp_get_wtime() - start;
+            stats->wait_seconds += omp_get_wtime() - start;
+            stats->loads++;
+            stats->bytes_read += size * group_cells->record_size;
+            stats->points_loaded += buffers[ix - g0].loaded;
+            stats->points_kept += buffers[ix - g0].len;
+        }
+
+        for (size_t step = 0; step < stream_blocks; step++) {
+            size_t block = (pass % 2 == 0) ? step : stream_blocks - 1 - step;
+            if ((long)block != held) {
+                size_t size = batch_len(block, batch_size, stream_cells->num_points);
+                double start = omp_get_wtime();
+                if (in_flight) {
+                    in_flight = 0;
+                    if (prefetch_wait(&prefetch) != 0) {
+                        return -1;
+                    }
+                    stats->load_seconds += prefetch.seconds;
+                    int filled = spare;
+                    spare = stream_buffer;
+                    stream_buffer = filled;
+                } else {
+                    if (load_batch(&buffers[stream_buffer], block * batch_size, size, stream_cells, 1) != 0) {
+                        return -1;
+                    }
+                    stats->load_seconds += omp_get_wtime() - start;
+                }
+                stats->wait_seconds += omp_get_wtime() - start;
+                stats->loads++;
+                stats->bytes_read += size * stream_cells->record_size;
+                stats->points_loaded += buffers[stream_buffer].loaded;
+                stats->points_kept += buffers[stream_buffer].len;
+                held = block;
+            }
+
+            if (pipelined && step + 1 < stream_blocks) {
+                size_t next = (pass % 2 == 0) ? block + 1 : block - 1;
+                if (prefetch_start(&prefetch, stream_cells, &buffers[spare], next * batch_size,
+                        batch_len(next, batch_size, stream_cells->num_points)) != 0) {
+                    return -1;
+                }
+                in_flight = 1;
+            }
+            for (size_t ix = g0; ix < g1; ix++) {
+                double_distance(&buffers[ix - g0], &buffers[stream_buffer], hists);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Incremental state (-i<state file>).
+The state keeps the histogram of the first num_points points of the cells file and the
+checksum of those points. Points appended since only add the pairs among themselves
+(run_schedule over the new range) and with the old points (run_bipartite), so an update
+costs time in proportion to the new points times N instead of N^2. The checksum makes
+sure the old points are still the ones the histogram was made of, at the price of one
+read over them. The file is replaced through a rename, so an interrupted run leaves the
+previous state intact.
+*/
+#define STATE_MAGIC "DHST"
+#define STATE_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t num_points;
+    uint64_t checksum;
+    uint64_t counts[NUM_BINS];
+} state_t;
+
+// 1 if the state was read, 0 if there is none yet, -1 if the file is not a state
+int state_load(const char *filename, state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    memcpy(state->magic, STATE_MAGIC, 4);
+    state->version = STATE_VERSION;
+    state->checksum = CHECKSUM_INIT;
+
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    state_t loaded;
+    size_t read = fread(&loaded, sizeof(loaded), 1, file);
+    fclose(file);
+    if (read != 1 || memcmp(loaded.magic, STATE_MAGIC, 4) != 0 || loaded.version != STATE_VERSION) {
+        return -1;
+    }
+    *state = loaded;
+    return 1;
+}
+
+int state_save(const char *filename, const state_t *state)
+{
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", filename) >= (int)sizeof(temp)) {
+        return -1;
+    }
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    if (fwrite(state, sizeof(*state), 1, file) != 1) {
+        fclose(file);
+        return -1;
+    }
+    if (fclose(file) != 0) {
+        return -1;
+    }
+    return rename(temp, filename);
+}
+
+// the points [first, first + n) of cells, as a cells file of their own
+static cells_t cells_range(const cells_t *cells, size_t first, size_t n)
+{
+    cells_t range = *cells;
+    range.data_offset += first * cells->record_size;
+    range.num_points = n;
+    return range;
+}
+
+static void stats_add(run_stats_t *sum, const run_stats_t *part)
+{
+    sum->loads += part->loads;
+    sum->bytes_read += part->bytes_read;
+    sum->points_loaded += part->points_loaded;
+    sum->points_kept += part->points_kept;
+    sum->load_seconds += part->load_seconds;
+    sum->wait_seconds += part->wait_seconds;
+}
+
+// the pairs the points after old_points add to the histogram of the first old_points
+int run_incremental(const cells_t *cells, size_t old_points, size_t batch_size, int resident,
+    int pipelined, block_t *buffers, thread_hist_t *hists, run_stats_t *stats)
+{
+    cells_t old_range = cells_range(cells, 0, old_points);
+    cells_t new_range = cells_range(cells, old_points, cells->num_points - old_points);
+    run_stats_t cross;
+
+    if (run_schedule(&new_range, batch_size, resident, pipelined, buffers, hists, stats) != 0) {
+        return -1;
+    }
+    // the new points are usually the smaller part and stay in groups
+    const cells_t *group = (new_range.num_points <= old_points) ? &new_range : &old_range;
+    const cells_t *stream = (group == &new_range) ? &old_range : &new_range;
+    if (run_bipartite(group, stream, batch_size, resident, pipelined, buffers, hists, &cross) != 0) {
+        return -1;
+    }
+    stats_add(stats, &cross);
+    return 0;
+}
+
+/* Points per block when n_blocks blocks share what is left of the budget, with the
+memory of the deduplicating mode if dedup is set. Large blocks
+are rounded down to whole column tiles, so no column tile of a full block is ragged;
+that costs at most an eighth of the block. */
+size_t block_points(int n_blocks, int dedup)
+{
+    size_t left = (mem_budget > mem_used) ? mem_budget - mem_used : 0;
+    // deduplication adds the multiplicities to every block and one scratch key array
+    size_t per_point = dedup ? n_blocks * (3 * sizeof(int16_t) + sizeof(uint32_t)) + sizeof(uint64_t)
+        : n_blocks * 3 * sizeof(int16_t);
+    size_t points = left / per_point;
+    points = points / BLOCK_PAD * BLOCK_PAD;
+    if (tile_rows != 0 && points >= 8 * tile_cols) {
+        points = points / tile_cols * tile_cols;
+    }
+    return points;
+}
+
+// splitmix64, the random numbers of the grid spread and of the sampling mode
+static inline uint64_t sample_mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Spatial-grid engine (-g<cells per axis>[,<radius>]).
+The cube [-10, 10]^3 is cut into g^3 cells. Pairs of points in cells at most radius
+cells apart on every axis are counted exactly, point by point with count_tile. The pairs
+of all other cells are aggregated: what they contribute only depends on the cell counts
+and the offset (dx, dy, dz) between the cells, so one pass over the counts gives the
+pair count P of every offset, and P is spread over the bins of that offset at once.
+The spread follows the distances of GRID_SAMPLES quasi-random point pairs of two uniform
+cells: a coordinate difference within one cell width is triangular on [-1, 1] widths,
+so the samples are the R3 low-discrepancy sequence through that inverse distribution.
+Every offset shifts the sequence by its own random vector (a Cranley-Patterson
+rotation), so its spread is unbiased and independent of the other offsets; with one
+sequence for all offsets their errors add up in the same bins. The engine is approximate
+only: the distances between two cells cover at least one cell width, 20001 / g >= 19
+units, which is more than the 10 units of a bin, so no far offset falls into one bin.
+The spread assumes uniform points inside a cell, and its standard error (from the
+binomial variance of the samples of every offset) only holds under that assumption; on
+clustered data the density inside the cells is the larger error. So every bin also gets
+a hard bound: its far pairs lie between zero and the pairs of all offsets whose range of
+bins covers it, whatever the points inside the cells do. That bound is loose, a bin is
+covered by many offsets; the far pairs up to a bin are bounded much more tightly, only
+the offsets whose range straddles the bin are uncertain. Bigger radii and finer grids
+narrow all of them.
+The exact part streams the file once per group of z slabs: all cells of the group and
+the radius slabs above it have to fit into the window block at once.
+*/
+#define GRID_MAX 1024
+#define GRID_SAMPLES 1024
+
+typedef struct {
+    int g;
+    int radius;
+    size_t n_cells;
+    uint32_t *count;  // points per cell, cells in (z, y, x) order
+    uint32_t *start;  // first point of each cell in the window block, during a pass
+    int32_t gap_min[GRID_MAX]; // smallest and largest coordinate difference between
+    int32_t gap_max[GRID_MAX]; // points of two cells that are d apart on an axis
+} grid_t;
+
+typedef struct {
+    size_t passes;
+    size_t bytes_read;
+    uint64_t exact_pairs;  // counted point by point
+    uint64_t spread_pairs; // aggregated
+    double spread_error[NUM_BINS]; // standard error of the spread per bin, uniform cells
+    double spread_bound[NUM_BINS]; // largest possible error of the spread per bin
+    double cumulative_bound[NUM_BINS]; // the same for the spread pairs up to the bin
+} grid_stats_t;
+
+static inline size_t grid_coord(int16_t value, int g)
+{
+    int32_t cell = ((int32_t)value + 10000) * g / 20001;
+    return (cell < 0) ? 0 : (cell >= g) ? (size_t)g - 1 : (size_t)cell;
+}
+
+static inline size_t grid_cell(const grid_t *grid, int16_t x, int16_t y, int16_t z)
+{
+    size_t g = grid->g;
+    return (grid_coord(z, g) * g + grid_coord(y, g)) * g + grid_coord(x, g);
+}
+
+// first coordinate of cell c on an axis, cell c covers [grid_low(c), grid_low(c + 1))
+static inline int32_t grid_low(int c, int g)
+{
+    return (int32_t)(((int64_t)c * 20001 + g - 1) / g) - 10000;
+}
+
+static void grid_gaps(grid_t *grid)
+{
+    int g = grid->g;
+    for (int d = 0; d < g; d++) {
+        int32_t lo = INT32_MAX, hi = 0;
+        for (int c = 0; c + d < g; c++) {
+            int32_t gap_lo = grid_low(c + d, g) - (grid_low(c + 1, g) - 1);
+            int32_t gap_hi = grid_low(c + d + 1, g) - 1 - grid_low(c, g);
+            lo = (gap_lo < lo) ? gap_lo : lo;
+            hi = (gap_hi > hi) ? gap_hi : hi;
+        }
+        grid->gap_min[d] = (lo < 0) ? 0 : lo;
+        grid->gap_max[d] = hi;
+    }
+}
+
+static int grid_stream(const grid_t *grid, const cells_t *cells, block_t *stage,
+    size_t first_cell, size_t last_cell, block_t *window, grid_stats_t *stats)
+{
+    size_t line_num = cells->num_points;
+    for (size_t first = 0; first < line_num; first += stage->capacity) {
+        size_t size = (line_num - first < stage->capacity) ? line_num - first : stage->capacity;
+        if (load_batch(stage, first, size, cells, 1) != 0) {
+            return -1;
+        }
+        for (size_t ix = 0; ix < size; ix++) {
+            size_t cell = grid_cell(grid, stage->x[ix], stage->y[ix], stage->z[ix]);
+            if (window == NULL) {
+                grid->count[cell]++;
+            } else if (cell >= first_cell && cell < last_cell) {
+                uint32_t slot = grid->start[cell]++;
+                window->x[slot] = stage->x[ix];
+                window->y[slot] = stage->y[ix];
+                window->z[slot] = stage->z[ix];
+            }
+        }
+    }
+    stats->passes++;
+    stats->bytes_read += line_num * cells->record_size;
+    return 0;
+}
+
+/* Pair counts per offset as the autocorrelation of the count grid.
+A(d) = sum_c n(c) n(c + d) over the signed offsets d is a correlation of the grid with
+itself, so it goes through a number-theoretic transform: the counts are zero-padded to
+len >= 2g - 1 per axis, which makes the cyclic correlation the linear one, and every
+axis is transformed in its own pass over independent rows. The arithmetic is modulo the
+prime p = 2^64 - 2^32 + 1, every A(d) is at most N^2 < p, so the counts come out exact
+where a floating-point FFT would round them. That takes O(g^3 log g) instead of the
+O(g^6) of pairing every two cells, and len^3 words of the budget while it runs.
+*/
+#define NTT_P 0xFFFFFFFF00000001ULL
+#define NTT_EPSILON 0xFFFFFFFFULL // 2^64 modulo p
+#define NTT_GENERATOR 7
+
+// branch-free, on random operands a branch mispredicts every other time
+static inline uint64_t ntt_sub(uint64_t a, uint64_t b)
+{
+    uint64_t diff;
+    uint64_t borrow = __builtin_sub_overflow(a, b, &diff);
+    return diff + (NTT_P & -borrow);
+}
+
+static inline uint64_t ntt_add(uint64_t a, uint64_t b)
+{
+    return ntt_sub(a, NTT_P - b);
+}
+
+static inline uint64_t ntt_mul(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = (unsigned __int128)a * b;
+    uint64_t lo = (uint64_t)product, hi = (uint64_t)(product >> 64);
+    // product = lo + (hi & eps) 2^64 + (hi >> 32) 2^96, and 2^64 = eps, 2^96 = -1 modulo p
+    uint64_t t, r;
+    uint64_t borrow = __builtin_sub_overflow(lo, hi >> 32, &t);
+    t -= NTT_EPSILON & -borrow;
+    uint64_t carry = __builtin_add_overflow(t, (hi & NTT_EPSILON) * NTT_EPSILON, &r);
+    r += NTT_EPSILON & -carry;
+    // r < 2^64 < 2p, one conditional subtraction makes it canonical
+    return ntt_sub(r, NTT_P);
+}
+
+static uint64_t ntt_pow(uint64_t base, uint64_t exponent)
+{
+    uint64_t result = 1;
+    for (; exponent > 0; exponent >>= 1) {
+        if (exponent & 1) {
+            result = ntt_mul(result, base);
+        }
+        base = ntt_mul(base, base);
+    }
+    return result;
+}
+
+// in-place transform of len values, twiddle[k] = w^k for a root w of order len
+static void ntt(uint64_t *a, size_t len, const uint64_t *twiddle)
+{
+    for (size_t ix = 1, jx = 0; ix < len; ix++) {
+        size_t bit = len >> 1;
+        for (; jx & bit; bit >>= 1) {
+            jx ^= bit;
+        }
+        jx |= bit;
+        if (ix < jx) {
+            uint64_t temp = a[ix];
+            a[ix] = a[jx];
+            a[jx] = temp;
+        }
+    }
+    for (size_t half = 1; half < len; half *= 2) {
+        size_t step = len / (2 * half);
+        for (size_t ix = 0; ix < len; ix += 2 * half) {
+            for (size_t k = 0; k < half; k++) {
+                uint64_t u = a[ix + k], v = ntt_mul(a[ix + k + half], twiddle[k * step]);
+                a[ix + k] = ntt_add(u, v);
+                a[ix + k + half] = ntt_sub(u, v);
+            }
+        }
+    }
+}
+
+/* Transform every row of the len^3 array along the y (stride len) or the z axis (stride
+len^2), NTT_BATCH neighbouring x rows at a time so the strided gathers use whole cache
+lines; the x rows themselves are contiguous, see ntt_rows. A coordinate that is still (forward) or again (inverse) in
+the spatial domain only has rows where it is a cell, c < g, or an offset the fold reads,
+c < g or c > len - g; spatial_x and spatial_o tell which of x and the third axis are. */
+#define NTT_BATCH 8
+
+static inline int ntt_row_needed(size_t c, size_t len, int g, int spatial, int inverse)
+{
+    return !spatial || c < (size_t)g || (inverse && c + g > len);
+}
+
+static void ntt_axis(uint64_t *a, size_t len, size_t stride, size_t other_stride, int g,
+    int spatial_x, int spatial_o, int inverse, const uint64_t *twiddle)
+{
+    size_t x_rows = (spatial_x && !inverse) ? (size_t)g : len;
+    size_t batches = (x_rows + NTT_BATCH - 1) / NTT_BATCH;
+
+    #pragma omp parallel for collapse(2) schedule(dynamic, 4) \
+        default(none) shared(a, len, stride, other_stride, g, spatial_x, spatial_o, inverse, twiddle, batches, x_rows)
+    for (size_t o = 0; o < len; o++) {
+        for (size_t batch = 0; batch < batches; batch++) {
+            if (!ntt_row_needed(o, len, g, spatial_o, inverse)) {
+                continue;
+            }
+            uint64_t rows[NTT_BATCH][2 * GRID_MAX];
+            uint64_t *base = a + o * other_stride;
+            size_t x0 = batch * NTT_BATCH;
+            size_t x1 = (x0 + NTT_BATCH < x_rows) ? x0 + NTT_BATCH : x_rows;
+            for (size_t c = 0; c < len; c++) {
+                for (size_t x = x0; x < x1; x++) {
+                    rows[x - x0][c] = base[c * stride + x];
+                }
+            }
+            for (size_t x = x0; x < x1; x++) {
+                if (ntt_row_needed(x, len, g, spatial_x, inverse)) {
+                    ntt(rows[x - x0], len, twiddle);
+                }
+            }
+            for (size_t c = 0; c < len; c++) {
+                for (size_t x = x0; x < x1; x++) {
+                    base[c * stride + x] = rows[x - x0][c];
+                }
+            }
+        }
+    }
+}
+
+// transform the x rows, contiguous, of the (z, y) rows that are needed
+static void ntt_rows(uint64_t *a, size_t len, int g, int spatial_yz, int inverse, const uint64_t *twiddle)
+{
+    #pragma omp parallel for collapse(2) schedule(dynamic, 16) \
+        default(none) shared(a, len, g, spatial_yz, inverse, twiddle)
+    for (size_t z = 0; z < len; z++) {
+        for (size_t y = 0; y < len; y++) {
+            if (ntt_row_needed(z, len, g, spatial_yz, inverse) && ntt_row_needed(y, len, g, spatial_yz, inverse)) {
+                ntt(a + (z * len + y) * len, len, twiddle);
+            }
+        }
+    }
+}
+
+// pairs of every offset |dz|, |dy|, |dx| between two distinct cells, at pairs[(dz * g + dy) * g + dx]
+static int grid_offset_pairs(const grid_t *grid, uint64_t *pairs)
+{
+    int g = grid->g;
+    size_t len = 1;
+    while (len < 2 * (size_t)g - 1) {
+        len *= 2;
+    }
+    size_t size = len * len * len;
+    uint64_t *a = (uint64_t *)mem_alloc(size * sizeof(uint64_t));
+    if (a == NULL) {
+        return -1;
+    }
+
+    static uint64_t twiddle[GRID_MAX], twiddle_inverse[GRID_MAX];
+    uint64_t root = ntt_pow(NTT_GENERATOR, (NTT_P - 1) / len);
+    uint64_t root_inverse = ntt_pow(root, NTT_P - 2);
+    twiddle[0] = twiddle_inverse[0] = 1;
+    for (size_t k = 1; k < len / 2; k++) {
+        twiddle[k] = ntt_mul(twiddle[k - 1], root);
+        twiddle_inverse[k] = ntt_mul(twiddle_inverse[k - 1], root_inverse);
+    }
+
+    memset(a, 0, size * sizeof(uint64_t));
+    for (size_t z = 0; z < (size_t)g; z++) {
+        for (size_t y = 0; y < (size_t)g; y++) {
+            for (size_t x = 0; x < (size_t)g; x++) {
+                a[(z * len + y) * len + x] = grid->count[(z * g + y) * g + x];
+            }
+        }
+    }
+    // x, then y, then z; the inverse goes back in the opposite order
+    ntt_rows(a, len, g, 1, 0, twiddle);
+    ntt_axis(a, len, len, len * len, g, 0, 1, 0, twiddle);
+    ntt_axis(a, len, len * len, len, g, 0, 0, 0, twiddle);
+
+    /* The correlation of the counts with themselves is the convolution with the reversed
+    counts, whose transform is F(-k): multiply every F(k) with F(-k), and by len^-3 for
+    the inverse transform. Each k and -k pair is handled by the smaller index. */
+    uint64_t scale = ntt_pow(ntt_pow(len, 3), NTT_P - 2);
+    #pragma omp parallel for schedule(dynamic) \
+        default(none) shared(a, len, scale)
+    for (size_t kz = 0; kz < len; kz++) {
+        for (size_t ky = 0; ky < len; ky++) {
+            for (size_t kx = 0; kx < len; kx++) {
+                size_t k = (kz * len + ky) * len + kx;
+                size_t neg = (((len - kz) % len) * len + (len - ky) % len) * len + (len - kx) % len;
+                if (k <= neg) {
+                    uint64_t product = ntt_mul(ntt_mul(a[k], a[neg]), scale);
+                    a[k] = a[neg] = product;
+                }
+            }
+        }
+    }
+    ntt_axis(a, len, len * len, len, g, 0, 0, 1, twiddle_inverse);
+    ntt_axis(a, len, len, len * len, g, 0, 1, 1, twiddle_inverse);
+    ntt_rows(a, len, g, 1, 1, twiddle_inverse);
+
+    /* A(d) counts the ordered cell pairs, every unordered pair appears as d and -d. The
+    offset 0 holds the pairs inside a cell, which grid_near counts exactly. */
+    #pragma omp parallel for \
+        default(none) shared(a, len, g, pairs)
+    for (size_t dz = 0; dz < (size_t)g; dz++) {
+        for (size_t dy = 0; dy < (size_t)g; dy++) {
+            for (size_t dx = 0; dx < (size_t)g; dx++) {
+                uint64_t sum = 0;
+                for (int sign = 0; sign < 8; sign++) {
+                    if (((sign & 1) && dz == 0) || ((sign & 2) && dy == 0) || ((sign & 4) && dx == 0)) {
+                        continue;
+                    }
+                    size_t sz = (sign & 1) ? len - dz : dz;
+                    size_t sy = (sign & 2) ? len - dy : dy;
+                    size_t sx = (sign & 4) ? len - dx : dx;
+                    sum += a[(sz * len + sy) * len + sx];
+                }
+                pairs[(dz * g + dy) * g + dx] = (dz + dy + dx == 0) ? 0 : sum / 2;
+            }
+        }
+    }
+    mem_free(a, size * sizeof(uint64_t));
+    return 0;
+}
+
+// bins of the nearest and farthest points of two cells dz, dy, dx apart
+static inline int32_t grid_min_bin(const grid_t *grid, int dz, int dy, int dx)
+{
+    const int32_t *gap = grid->gap_min;
+    return distance_bin(gap[dz] * gap[dz] + gap[dy] * gap[dy] + gap[dx] * gap[dx]);
+}
+
+static inline int32_t grid_max_bin(const grid_t *grid, int dz, int dy, int dx)
+{
+    const int32_t *gap = grid->gap_max;
+    return distance_bin(gap[dz] * gap[dz] + gap[dy] * gap[dy] + gap[dx] * gap[dx]);
+}
+
+// spread the pairs of the far offsets over the histograms, with their standard error and bound
+static void grid_spread(const grid_t *grid, const uint64_t *pairs, thread_hist_t *hists, grid_stats_t *stats)
+{
+    int g = grid->g, radius = grid->radius;
+    double width = 20001.0 / g;
+    uint64_t spread_pairs = 0;
+    double *variance = stats->spread_error;
+    static uint64_t spread[NUM_BINS], cover[NUM_BINS]; // pairs spread into and possible in a bin
+    static uint64_t first[NUM_BINS], last[NUM_BINS]; // pairs of the offsets whose range starts, ends in a bin
+    static float sequence[3][GRID_SAMPLES];
+
+    const double alpha[3] = {0.8191725133961645, 0.6710436067037893, 0.5497004779019703};
+    for (int axis = 0; axis < 3; axis++) {
+        for (int k = 0; k < GRID_SAMPLES; k++) {
+            sequence[axis][k] = (float)fmod(0.5 + alpha[axis] * (k + 1), 1.0);
+        }
+    }
+    memset(variance, 0, NUM_BINS * sizeof(double));
+    memset(spread, 0, sizeof(spread));
+    memset(cover, 0, sizeof(cover));
+    memset(first, 0, sizeof(first));
+    memset(last, 0, sizeof(last));
+
+    #pragma omp parallel reduction(+:spread_pairs, variance[:NUM_BINS], spread[:NUM_BINS], cover[:NUM_BINS], \
+        first[:NUM_BINS], last[:NUM_BINS]) \
+        default(none) shared(g, radius, width, grid, pairs, hists, sequence)
+    {
+        uint64_t *total = hists[omp_get_thread_num()].total;
+        uint32_t hits[NUM_BINS] = {0};
+        float d[3][GRID_SAMPLES];
+        int32_t d2[GRID_SAMPLES];
+
+        #pragma omp for schedule(dynamic)
+        for (int dz = 0; dz < g; dz++) {
+            for (int dy = 0; dy < g; dy++) {
+                for (int dx = 0; dx < g; dx++) {
+                    size_t offset = ((size_t)dz * g + dy) * g + dx;
+                    uint64_t n = pairs[offset];
+                    if (n == 0 || (dz <= radius && dy <= radius && dx <= radius)) {
+                        continue;
+                    }
+                    int32_t lo = grid_min_bin(grid, dz, dy, dx), hi = grid_max_bin(grid, dz, dy, dx);
+
+                    // one axis at a time, so the loops vectorize; float is plenty within a cell
+                    const int cells[3] = {dx, dy, dz};
+                    for (int axis = 0; axis < 3; axis++) {
+                        float shift = (sample_mix(3 * offset + axis) >> 40) * 0x1.0p-24f;
+                        for (int k = 0; k < GRID_SAMPLES; k++) {
+                            float u = sequence[axis][k] + shift;
+                            u -= (u >= 1.0f) ? 1.0f : 0.0f;
+                            float tail = 1.0f - sqrtf(2.0f * ((u < 0.5f) ? u : 1.0f - u));
+                            d[axis][k] = (cells[axis] + ((u < 0.5f) ? -tail : tail)) * width;
+                        }
+                    }
+                    for (int k = 0; k < GRID_SAMPLES; k++) {
+                        double sq = (double)d[0][k] * d[0][k] + (double)d[1][k] * d[1][k] + (double)d[2][k] * d[2][k];
+                        // sub-cells of the outermost cells reach past the cube
+                        d2[k] = (sq < MAX_SQ_DISTANCE) ? (int32_t)(sq + 0.5) : MAX_SQ_DISTANCE;
+                    }
+                    for (int k = 0; k < GRID_SAMPLES; k++) {
+                        int32_t bin = distance_bin(d2[k]);
+                        hits[(bin < lo) ? lo : (bin > hi) ? hi : bin]++;
+                    }
+
+                    first[lo] += n;
+                    last[hi] += n;
+
+                    // bin b gets the pairs up to its share of the samples, so they sum to n
+                    uint32_t below = 0;
+                    for (int32_t bin = lo; bin <= hi; bin++) {
+                        cover[bin] += n;
+                        if (hits[bin] == 0) {
+                            continue;
+                        }
+                        double share = (double)hits[bin] / GRID_SAMPLES;
+                        uint64_t part = (uint64_t)((unsigned __int128)n * (below + hits[bin]) / GRID_SAMPLES
+                            - (unsigned __int128)n * below / GRID_SAMPLES);
+                        total[bin] += part;
+                        spread[bin] += part;
+                        variance[bin] += (double)n * n * share * (1.0 - share) / GRID_SAMPLES;
+                        below += hits[bin];
+                        hits[bin] = 0;
+                    }
+                    spread_pairs += n;
+                }
+            }
+        }
+    }
+    uint64_t spread_below = 0, surely_below = 0, maybe_below = 0;
+    for (size_t bin = 0; bin < NUM_BINS; bin++) {
+        variance[bin] = sqrt(variance[bin]);
+        // the true far pairs of the bin are somewhere in [0, cover]
+        uint64_t above = cover[bin] - spread[bin];
+        stats->spread_bound[bin] = (double)((spread[bin] > above) ? spread[bin] : above);
+        // and those up to the bin at least the offsets ending by it, at most those started
+        spread_below += spread[bin];
+        surely_below += last[bin];
+        maybe_below += first[bin];
+        above = maybe_below - spread_below;
+        stats->cumulative_bound[bin] = (double)((spread_below - surely_below > above) ? spread_below - surely_below : above);
+    }
+    stats->spread_pairs += spread_pairs;
+}
+
+// the exact pairs of the cells [first_cell, last_cell) with their near cells, all in window
+static void grid_near(const grid_t *grid, size_t first_cell, size_t last_cell, const block_t *window,
+    thread_hist_t *hists)
+{
+    int g = grid->g, radius = grid->radius;
+    const uint32_t *count = grid->count, *start = grid->start;
+
+    #pragma omp parallel \
+        default(none) shared(g, radius, count, start, first_cell, last_cell, window, hists)
+    {
+        thread_hist_t *hist = &hists[omp_get_thread_num()];
+        double begin = omp_get_wtime();
+
+        #pragma omp for schedule(dynamic, 16) nowait
+        for (size_t a = first_cell; a < last_cell; a++) {
+            size_t n_a = count[a];
+            if (n_a == 0) {
+                continue;
+            }
+            size_t a0 = start[a], a1 = a0 + n_a;
+            int az = a / ((size_t)g * g), ay = a / g % g, ax = a % g;
+
+            for (size_t ix = a0; ix + 1 < a1; ix++) {
+                count_tile(window, ix, ix + 1, window, ix + 1, a1, hist);
+            }
+            hist->self_pairs += n_a * (n_a - 1) / 2;
+
+            // the near cells after a in (z, y, x) order
+            for (int bz = az; bz <= az + radius && bz < g; bz++) {
+                for (int by = ay - radius; by <= ay + radius; by++) {
+                    for (int bx = ax - radius; bx <= ax + radius; bx++) {
+                        if (by < 0 || by >= g || bx < 0 || bx >= g) {
+                            continue;
+                        }
+                        size_t b = ((size_t)bz * g + by) * g + bx;
+                        if (b <= a || count[b] == 0) {
+                            continue;
+                        }
+                        size_t b0 = start[b];
+                        count_tile(window, a0, a1, window, b0, b0 + count[b], hist);
+                        hist->cross_pairs += n_a * count[b];
+                    }
+                }
+            }
+        }
+        hist->self_seconds += omp_get_wtime() - begin;
+    }
+}
+
+/* Report an error of the spread at the fullest bin, and the largest relative one of the
+bins that hold at least a hundredth of the fullest. */
+static void grid_report(const char *name, const double *error, const size_t *counter)
+{
+    size_t fullest = 0, worst = 0;
+    for (size_t bin = 0; bin < NUM_BINS; bin++) {
+        fullest = (counter[bin] > counter[fullest]) ? bin : fullest;
+    }
+    double worst_error = 0.0;
+    for (size_t bin = 0; bin < NUM_BINS; bin++) {
+        if (counter[bin] > 0 && counter[bin] >= counter[fullest] / 100 && error[bin] / counter[bin] > worst_error) {
+            worst = bin;
+            worst_error = error[bin] / counter[bin];
+        }
+    }
+    fprintf(stderr, "grid: %s %.0f (%.3f%%) at the fullest bin %05.2f, largest %.3f%% at bin %05.2f\n", name,
+        error[fullest], 100.0 * error[fullest] / (counter[fullest] > 0 ? counter[fullest] : 1), fullest / 100.0,
+        100.0 * worst_error, worst / 100.0);
+}
+
+/* Run the grid engine. Without aggregate only the near pairs are counted, which is what
+the cutoff mode needs. */
+int grid_run(const cells_t *cells, int g, int radius, int aggregate, thread_hist_t *hists, int n_threads,
+    grid_stats_t *stats)
+{
+    grid_t grid;
+    grid.g = g;
+    grid.radius = radius;
+    grid.n_cells = (size_t)g * g * g;
+    grid_gaps(&grid);
+    memset(stats, 0, sizeof(*stats));
+
+    size_t slab = (size_t)g * g;
+    grid.count = (uint32_t *)mem_alloc(grid.n_cells * sizeof(uint32_t));
+    grid.start = (uint32_t *)mem_alloc(grid.n_cells * sizeof(uint32_t));
+    uint64_t *pairs = aggregate ? (uint64_t *)mem_alloc(grid.n_cells * sizeof(uint64_t)) : NULL;
+    // the stage block takes the file in pieces of at most 8 map windows
+    block_t stage;
+    size_t left = (mem_budget > mem_used) ? mem_budget - mem_used : 0;
+    size_t stage_points = left / 4 / (3 * sizeof(int16_t)) / BLOCK_PAD * BLOCK_PAD;
+    stage_points = (stage_points > 8 * MAP_WINDOW) ? 8 * MAP_WINDOW : stage_points;
+    if (grid.count == NULL || grid.start == NULL || (aggregate && pairs == NULL)
+            || stage_points == 0 || block_alloc(&stage, stage_points, 0) != 0) {
+        printf("memory budget too small for a grid of %d^3 cells\n", g);
+        return -1;
+    }
+    memset(grid.count, 0, grid.n_cells * sizeof(uint32_t));
+
+    if (grid_stream(&grid, cells, &stage, 0, 0, NULL, stats) != 0) {
+        printf("error reading file\n");
+        return -1;
+    }
+    if (aggregate) {
+        if (grid_offset_pairs(&grid, pairs) != 0) {
+            printf("memory budget too small for a grid of %d^3 cells\n", g);
+            return -1;
+        }
+        grid_spread(&grid, pairs, hists, stats);
+        mem_free(pairs, grid.n_cells * sizeof(uint64_t));
+    }
+
+    // the window block gets the rest of the budget
+    block_t window;
+    left = (mem_budget > mem_used) ? mem_budget - mem_used : 0;
+    size_t window_points = left / (3 * sizeof(int16_t)) / BLOCK_PAD * BLOCK_PAD;
+    if (window_points == 0 || block_alloc(&window, window_points, 0) != 0) {
+        printf("memory budget too small for a grid of %d^3 cells\n", g);
+        return -1;
+    }
+
+    // groups of z slabs [z0, z1) whose points fit into the window with radius slabs above
+    int z0 = 0;
+    while (z0 < g) {
+        size_t points = 0;
+        int z1 = z0;
+        while (z1 < g) {
+            int top = (z1 + 1 + radius < g) ? z1 + 1 + radius : g;
+            size_t needed = 0;
+            for (size_t cell = (size_t)z0 * slab; cell < (size_t)top * slab; cell++) {
+                needed += grid.count[cell];
+            }
+            if (needed > window.capacity) {
+                break;
+            }
+            points = needed;
+            z1++;
+        }
+        if (z1 == z0) {
+            printf("memory budget too small for the points of %d grid slabs\n", radius + 1);
+            return -1;
+        }
+        int top = (z1 + radius < g) ? z1 + radius : g;
+        size_t first_cell = (size_t)z0 * slab, last_cell = (size_t)top * slab;
+        uint32_t offset = 0;
+        for (size_t cell = first_cell; cell < last_cell; cell++) {
+            grid.start[cell] = offset;
+            offset += grid.count[cell];
+        }
+        if (grid_stream(&grid, cells, &stage, first_cell, last_cell, &window, stats) != 0) {
+            printf("error reading file\n");
+            return -1;
+        }
+        // the stream advanced every start to the end of its cell
+        for (size_t cell = first_cell; cell < last_cell; cell++) {
+            grid.start[cell] -= grid.count[cell];
+        }
+        window.len = points;
+        grid_near(&grid, first_cell, (size_t)z1 * slab, &window, hists);
+        z0 = z1;
+    }
+
+    for (int thread = 0; thread < n_threads; thread++) {
+        stats->exact_pairs += hists[thread].self_pairs + hists[thread].cross_pairs;
+    }
+    block_free(&window);
+    block_free(&stage);
+    mem_free(grid.start, grid.n_cells * sizeof(uint32_t));
+    mem_free(grid.count, grid.n_cells * sizeof(uint32_t));
+    return 0;
+}
+
+/* Cutoff mode (-r<cutoff>).
+Only the bins below the cutoff are wanted, so the grid engine runs without its aggregated
+part, on the finest grid where cells two apart are at least the cutoff apart on an axis.
+A pair closer than the cutoff then always lies in neighbouring cells (radius 1), and
+every point is only paired with the points of 27 cells instead of all N. The near cells
+also contribute pairs beyond the cutoff; those bins are incomplete and left out, a bin
+is printed when all of its squared distances lie below the cutoff.
+The per-cell arrays take at most a quarter of the budget left; a coarser grid than the
+cutoff allows is still exact, only slower.
 */
-#define BATCH_SIZE 400000
+int cutoff_grid(int32_t cutoff)
+{
+    grid_t grid;
+    size_t left = (mem_budget > mem_used) ? mem_budget - mem_used : 0;
+    for (grid.g = GRID_MAX; grid.g > 1; grid.g--) {
+        size_t cells = (size_t)grid.g * grid.g * grid.g;
+        if (cells * 2 * sizeof(uint32_t) > left / 4) {
+            continue;
+        }
+        grid_gaps(&grid);
+        if (grid.g < 3 || grid.gap_min[2] >= cutoff) {
+            break;
+        }
+    }
+    return grid.g;
+}
 
-void load_batch(int16_t (*batch)[3], size_t size, FILE* file)
+// first bin that may hold a pair at or beyond the cutoff
+static size_t cutoff_bins(int32_t cutoff)
 {
-    char per_line[25]; // for storing a line's info
-    char temp_str[7]; // for string to integer
-    for (size_t line = 0; line < size; line++) {
-        fgets(per_line, 25, file);
-        for (size_t ix = 0; ix < 3; ++ix) {
-            memcpy(temp_str, &per_line[ix * 8], 3);
-            memcpy(temp_str+3, &per_line[ix * 8 + 4], 3);
-            temp_str[6] = '\0';
-            batch[line][ix] = (int16_t)atoi(temp_str);
+    size_t bin = 0;
+    int64_t limit = (int64_t)cutoff * cutoff;
+    while (bin < NUM_BINS) {
+        // the sentinel is past MAX_SQ_DISTANCE, which is the real end of the last bin
+        int64_t end = (bin + 1 < NUM_BINS) ? bin_bound[bin + 1] : (int64_t)MAX_SQ_DISTANCE + 1;
+        if (end > limit) {
+            break;
         }
+        bin++;
     }
+    return bin;
 }
 
-inline int16_t calculate_distance(int16_t *num_1, int16_t *num_2)
+/* Pair-sampling estimator (-s<budget>, -S<seed>).
+Draws pairs of distinct points uniformly and scales the bin frequencies up to all
+N (N - 1) / 2 pairs, so the run time depends on the number of samples instead of N^2.
+Sample k is a pure function of the seed and k (splitmix64 of a counter), so a given
+number of samples gives the same histogram for any number of threads.
+The samples touch the file in random order. Instead of mapping all of it, every round
+radix sorts the point indices it draws and gathers them in file order with pread, one
+read per run of indices within SAMPLE_CHUNK records, into the points array of the round.
+The keys, their sort scratch and the points of a round are the only memory, at most half
+of what the budget leaves.
+Sampling goes in rounds of up to SAMPLE_ROUND pairs until the budget is used up: a number
+of pairs, a time in seconds, or a target relative error, the 95% half-width of the fullest
+bin over its estimate. Every bin is printed with its 95% Wilson score interval.
+*/
+#define SAMPLE_ROUND 65536
+#define SAMPLE_CHUNK 256
+#define SAMPLE_SLOT_BITS 20 // a key is point index << SAMPLE_SLOT_BITS | slot in the round
+#define SAMPLE_RADIX_BITS 11
+#define SAMPLE_Z 1.959963984540054 // two-sided 95% normal quantile
+
+typedef struct {
+    size_t pairs;     // stop after this many samples, 0 for no limit
+    double seconds;   // stop after this time, 0 for no limit
+    double rel_error; // stop at this relative error of the fullest bin, 0 for no limit
+    uint64_t seed;
+} sample_budget_t;
+
+typedef struct {
+    size_t pairs;
+    double seconds;
+    double rel_error;
+} sample_stats_t;
+
+// uniform in [0, n) from 64 random bits
+static inline size_t sample_below(uint64_t bits, size_t n)
 {
-    float temp = sqrt((num_1[0] - num_2[0]) * (num_1[0] - num_2[0])
-        + (num_1[1] - num_2[1]) * (num_1[1] - num_2[1])
-        + (num_1[2] - num_2[2]) * (num_1[2] - num_2[2]));
-    return (int16_t)(temp / 10);
+    return (size_t)(((unsigned __int128)bits * n) >> 64);
+}
+
+static inline void decode_point(const cells_t *cells, const char *record, int16_t point[3])
+{
+    if (cells->binary) {
+        memcpy(point, record, BINARY_RECORD_SIZE);
+    } else {
+        point[0] = parse_coord(record);
+        point[1] = parse_coord(record + 8);
+        point[2] = parse_coord(record + 16);
+    }
+}
+
+// sort the n keys by point index, LSD radix with scratch of n keys, the result in keys
+static void sample_sort(uint64_t *keys, uint64_t *scratch, size_t n, size_t line_num)
+{
+    size_t counts[1 << SAMPLE_RADIX_BITS];
+    for (int shift = SAMPLE_SLOT_BITS; (line_num - 1) >> (shift - SAMPLE_SLOT_BITS) > 0; shift += SAMPLE_RADIX_BITS) {
+        const size_t mask = (1 << SAMPLE_RADIX_BITS) - 1;
+        memset(counts, 0, sizeof(counts));
+        for (size_t ix = 0; ix < n; ix++) {
+            counts[(keys[ix] >> shift) & mask]++;
+        }
+        for (size_t digit = 0, sum = 0; digit <= mask; digit++) {
+            size_t count = counts[digit];
+            counts[digit] = sum;
+            sum += count;
+        }
+        for (size_t ix = 0; ix < n; ix++) {
+            scratch[counts[(keys[ix] >> shift) & mask]++] = keys[ix];
+        }
+        memcpy(keys, scratch, n * sizeof(uint64_t));
+    }
 }
 
-void self_distance(int16_t (*batch)[3], size_t len, size_t *count)
+/* Read the points of the n sorted keys into points[slot]. Every thread takes a range of
+the keys and reads a chunk whenever a key lies past its current one. */
+static int sample_gather(const cells_t *cells, const uint64_t *keys, size_t n, int16_t (*points)[3])
 {
-    size_t ix, jx;
-    int16_t distance;
+    int error = 0;
 
-    #pragma omp parallel for \
-        default(none) private(ix, jx, distance) \
-        shared(batch, len) reduction(+:count[:3465])
+    #pragma omp parallel reduction(|:error) \
+        default(none) shared(cells, keys, n, points)
+    {
+        char chunk[SAMPLE_CHUNK * RECORD_SIZE];
+        size_t chunk_first = 0, chunk_count = 0;
+        int thread = omp_get_thread_num(), n_threads = omp_get_num_threads();
+        size_t begin = n * thread / n_threads, end = n * (thread + 1) / n_threads;
 
-    for (ix = 0; ix < len - 1; ix++) {
-        for (jx = ix + 1; jx < len; jx++) {
-            distance = calculate_distance(batch[ix], batch[jx]);
-            count[distance] += 1;
+        for (size_t ix = begin; ix < end && !error; ix++) {
+            size_t index = keys[ix] >> SAMPLE_SLOT_BITS;
+            if (index - chunk_first >= chunk_count) {
+                // up to the last key of the range within SAMPLE_CHUNK records
+                size_t last = ix;
+                while (last + 1 < end && (keys[last + 1] >> SAMPLE_SLOT_BITS) - index < SAMPLE_CHUNK) {
+                    last++;
+                }
+                chunk_first = index;
+                chunk_count = (keys[last] >> SAMPLE_SLOT_BITS) - index + 1;
+                size_t offset = cells->data_offset + index * cells->record_size;
+                size_t bytes = chunk_count * cells->record_size;
+                bytes = (offset + bytes > cells->file_size) ? cells->file_size - offset : bytes;
+                if (pread(cells->fd, chunk, bytes, (off_t)offset) != (ssize_t)bytes) {
+                    error = 1;
+                }
+            }
+            decode_point(cells, chunk + (index - chunk_first) * cells->record_size,
+                points[keys[ix] & ((1 << SAMPLE_SLOT_BITS) - 1)]);
         }
     }
+    return error ? -1 : 0;
 }
 
-void double_distance(int16_t (*batch_1)[3], int16_t (*batch_2)[3], size_t len_1, size_t len_2, size_t *count)
+// Wilson score interval of the frequency of count in n samples
+static void sample_interval(size_t count, size_t n, double *lo, double *hi)
 {
-    size_t ix, jx;
-    int16_t distance;
-    
-    #pragma omp parallel for \
-        default(none) private(ix, jx, distance) \
-        shared(batch_1, batch_2, len_1, len_2) reduction(+:count[:3465])
+    double p = (double)count / n, z2 = SAMPLE_Z * SAMPLE_Z;
+    double centre = (p + z2 / (2.0 * n)) / (1.0 + z2 / n);
+    double half = SAMPLE_Z / (1.0 + z2 / n) * sqrt(p * (1.0 - p) / n + z2 / (4.0 * n * n));
+    *lo = (centre - half > 0.0) ? centre - half : 0.0;
+    *hi = (centre + half < 1.0) ? centre + half : 1.0;
+}
+
+int sample_run(const cells_t *cells, const sample_budget_t *budget, thread_hist_t *hists, int n_threads,
+    sample_stats_t *stats)
+{
+    size_t line_num = cells->num_points;
+    double start = omp_get_wtime();
+    size_t done = 0;
+    memset(stats, 0, sizeof(*stats));
+    if (line_num < 2) {
+        return 0;
+    }
+
+    // every pair takes two keys, their scratch and two points
+    size_t left = (mem_budget > mem_used) ? mem_budget - mem_used : 0;
+    size_t max_round = left / 2 / (2 * (2 * sizeof(uint64_t) + 3 * sizeof(int16_t)));
+    max_round = (max_round > SAMPLE_ROUND) ? SAMPLE_ROUND : max_round;
+    uint64_t *keys = (uint64_t *)mem_alloc(2 * max_round * sizeof(uint64_t));
+    uint64_t *scratch = (uint64_t *)mem_alloc(2 * max_round * sizeof(uint64_t));
+    int16_t (*points)[3] = (int16_t (*)[3])mem_alloc(2 * max_round * 3 * sizeof(int16_t));
+    if (max_round == 0 || keys == NULL || scratch == NULL || points == NULL) {
+        printf("memory budget too small for sampling\n");
+        return -1;
+    }
+
+    int status = 0;
+    for (;;) {
+        size_t round = max_round;
+        if (budget->pairs > 0 && budget->pairs - done < round) {
+            round = budget->pairs - done;
+        }
+
+        #pragma omp parallel for \
+            default(none) shared(budget, keys, line_num, round, done)
+        for (size_t k = 0; k < round; k++) {
+            uint64_t sample = done + k;
+            size_t first = sample_below(sample_mix(budget->seed ^ sample_mix(2 * sample)), line_num);
+            size_t second = sample_below(sample_mix(budget->seed ^ sample_mix(2 * sample + 1)), line_num - 1);
+            second += (second >= first);
+            keys[2 * k] = (uint64_t)first << SAMPLE_SLOT_BITS | (2 * k);
+            keys[2 * k + 1] = (uint64_t)second << SAMPLE_SLOT_BITS | (2 * k + 1);
+        }
+        sample_sort(keys, scratch, 2 * round, line_num);
+        if (sample_gather(cells, keys, 2 * round, points) != 0) {
+            status = -1;
+            break;
+        }
+
+        #pragma omp parallel for \
+            default(none) shared(hists, points, round)
+        for (size_t k = 0; k < round; k++) {
+            uint64_t *total = hists[omp_get_thread_num()].total;
+            const int16_t *a = points[2 * k], *b = points[2 * k + 1];
+            int32_t dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+            total[distance_bin(dx * dx + dy * dy + dz * dz)]++;
+        }
+        done += round;
+        stats->seconds = omp_get_wtime() - start;
+
+        // relative half-width at the fullest bin
+        size_t peak = 0;
+        for (size_t bin = 0; bin < NUM_BINS; bin++) {
+            size_t count = 0;
+            for (int thread = 0; thread < n_threads; thread++) {
+                count += hists[thread].total[bin];
+            }
+            peak = (count > peak) ? count : peak;
+        }
+        double lo, hi;
+        sample_interval(peak, done, &lo, &hi);
+        stats->rel_error = (hi - lo) / 2.0 / ((double)peak / done);
+        stats->pairs = done;
+
+        if ((budget->pairs > 0 && done >= budget->pairs)
+                || (budget->seconds > 0.0 && stats->seconds >= budget->seconds)
+                || (budget->rel_error > 0.0 && stats->rel_error <= budget->rel_error)) {
+            break;
+        }
+    }
+    mem_free(points, 2 * max_round * 3 * sizeof(int16_t));
+    mem_free(scratch, 2 * max_round * sizeof(uint64_t));
+    mem_free(keys, 2 * max_round * sizeof(uint64_t));
+    return status;
+}
 
-    for (ix = 0; ix < len_1; ix++) {
-        for (jx = 0; jx < len_2; jx++) {
-            distance = calculate_distance(batch_1[ix], batch_2[jx]);
-            count[distance] += 1;
+// estimated pairs of every sampled bin, with the 95% interval
+void sample_print(const size_t *counter, size_t line_num, const sample_stats_t *stats)
+{
+    double all_pairs = (double)line_num * (line_num - 1) / 2.0;
+    for (size_t ix = 0; ix < NUM_BINS; ++ix) {
+        if (counter[ix] != 0) {
+            double lo, hi;
+            sample_interval(counter[ix], stats->pairs, &lo, &hi);
+            printf("%05.2f %.0f %.0f %.0f\n", ix/100.0, all_pairs * counter[ix] / stats->pairs,
+                all_pairs * lo, all_pairs * hi);
         }
     }
 }
 
+/* JSON run report (-j<file>), for dashboards. Seconds are wall-clock, the per-thread
+seconds are the kernel time of each thread up to its own end. The share of the phases
+in the total tells whether a run was bound by loading and parsing or by the kernels. */
+static void json_phase(FILE *file, const char *name, const phase_t *phase, const char *amount, double total)
+{
+    fprintf(file, "    \"%s\": {\"calls\": %zu, \"seconds\": %.6f, \"max_seconds\": %.6f, \"%s\": %lu, "
+        "\"share\": %.4f},\n", name, phase->calls, phase->seconds, phase->max_seconds, amount, phase->amount,
+        (total > 0.0) ? phase->seconds / total : 0.0);
+}
+
+int write_report(const char *filename, const char *mode, size_t points, size_t pairs, int n_threads,
+    const thread_hist_t *hists, double seconds, double output_seconds)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "{\n");
+    fprintf(file, "  \"mode\": \"%s\",\n", mode);
+    fprintf(file, "  \"points\": %zu,\n", points);
+    fprintf(file, "  \"pairs\": %zu,\n", pairs);
+    fprintf(file, "  \"threads\": %d,\n", n_threads);
+    fprintf(file, "  \"memory_budget\": %zu,\n", mem_budget);
+    fprintf(file, "  \"tile_rows\": %zu,\n", tile_rows);
+    fprintf(file, "  \"tile_cols\": %zu,\n", tile_cols);
+    fprintf(file, "  \"seconds\": %.6f,\n", seconds);
+    fprintf(file, "  \"pairs_per_second\": %.6e,\n", (seconds > 0.0) ? pairs / seconds : 0.0);
+    fprintf(file, "  \"phases\": {\n");
+    json_phase(file, "load_batch", &phase_load, "bytes", seconds);
+    json_phase(file, "self_distance", &phase_self, "pairs", seconds);
+    json_phase(file, "double_distance", &phase_cross, "pairs", seconds);
+    fprintf(file, "    \"output\": {\"seconds\": %.6f}\n", output_seconds);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"per_thread\": [\n");
+    for (int thread = 0; thread < n_threads; thread++) {
+        const thread_hist_t *hist = &hists[thread];
+        double busy = hist->self_seconds + hist->cross_seconds;
+        uint64_t thread_pairs = hist->self_pairs + hist->cross_pairs;
+        fprintf(file, "    {\"thread\": %d, \"self_pairs\": %lu, \"self_seconds\": %.6f, \"cross_pairs\": %lu, "
+            "\"cross_seconds\": %.6f, \"pairs_per_second\": %.6e}%s\n", thread, hist->self_pairs,
+            hist->self_seconds, hist->cross_pairs, hist->cross_seconds,
+            (busy > 0.0) ? thread_pairs / busy : 0.0, (thread + 1 < n_threads) ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+    return fclose(file);
+}
+
+#ifdef USE_MPI
+// the MPI build wraps main in MPI_Init and MPI_Finalize, see the end of the file
+#define main distances_main
+#endif
+
 int main(int argc, char* argv[])
 {
     // counter vector for tracking counted numbers
-    size_t counter[3465] = {0};
+    size_t counter[NUM_BINS] = {0};
     
     // read command line arguments
     int n_threads = 1;
-    char* ptr = strchr(argv[1], 't');
-    if (ptr) {
-        n_threads = strtol(++ptr, NULL, 10);
+    int report = 0;
+    int pipelined = 0;
+    int resident = 2;
+    int tiles_set = 0;
+    int dedup = 0;
+    int grid = 0;
+    int radius = 1;
+    int sampling = 0;
+    double cutoff = 0.0;
+    int32_t cutoff_units = 0;
+    const char *other_file = NULL;
+    const char *state_file = NULL;
+    const char *report_file = NULL;
+    sample_budget_t budget = {0, 0.0, 0.0, 1};
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-t", 2) == 0) {
+            n_threads = strtol(argv[i] + 2, NULL, 10);
+        } else if (strncmp(argv[i], "-m", 2) == 0) {
+            // -m<bytes>, with an optional k, M or G suffix
+            char *end;
+            mem_budget = strtoull(argv[i] + 2, &end, 10);
+            if (*end == 'k' || *end == 'K') {
+                mem_budget <<= 10;
+                end++;
+            } else if (*end == 'm' || *end == 'M') {
+                mem_budget <<= 20;
+                end++;
+            } else if (*end == 'g' || *end == 'G') {
+                mem_budget <<= 30;
+                end++;
+            }
+            if (*end != '\0' || mem_budget == 0) {
+                printf("invalid memory budget %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "-T", 2) == 0) {
+            tiles_set = 1;
+            // -T<rows>x<cols>, or -T0 for the untiled loop nest
+            char *end;
+            tile_rows = strtoul(argv[i] + 2, &end, 10);
+            if (*end == 'x') {
+                tile_cols = strtoul(end + 1, &end, 10);
+            }
+            if (*end != '\0' || (tile_rows != 0 && tile_cols == 0)) {
+                printf("invalid tile size %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            report = 1;
+        } else if (strncmp(argv[i], "-g", 2) == 0) {
+            // -g<cells per axis>[,<radius>]
+            char *end;
+            grid = strtol(argv[i] + 2, &end, 10);
+            if (*end == ',') {
+                radius = strtol(end + 1, &end, 10);
+            }
+            if (*end != '\0' || grid < 1 || grid > GRID_MAX || radius < 0) {
+                printf("invalid grid %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "-s", 2) == 0) {
+            // -s<pairs>[kMG], -s<seconds>s or -s<relative error>%
+            char *end;
+            double value = strtod(argv[i] + 2, &end);
+            sampling = 1;
+            if (*end == 's') {
+                budget.seconds = value;
+                end++;
+            } else if (*end == '%') {
+                budget.rel_error = value / 100.0;
+                end++;
+            } else {
+                double scale = (*end == 'k') ? 1e3 : (*end == 'M') ? 1e6 : (*end == 'G') ? 1e9 : 1.0;
+                end += (scale > 1.0);
+                budget.pairs = (size_t)(value * scale);
+            }
+            if (*end != '\0' || !(value > 0.0) || (budget.pairs == 0 && budget.seconds == 0.0 && budget.rel_error == 0.0)) {
+                printf("invalid sampling budget %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "-r", 2) == 0) {
+            // -r<cutoff distance>
+            char *end;
+            cutoff = strtod(argv[i] + 2, &end);
+            if (*end != '\0' || !(cutoff > 0.0)) {
+                printf("invalid cutoff %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "-S", 2) == 0) {
+            budget.seed = strtoull(argv[i] + 2, NULL, 10);
+        } else if (strncmp(argv[i], "-b", 2) == 0) {
+            // -b<file>: only the pairs between the cells file and this one
+            other_file = argv[i] + 2;
+            if (*other_file == '\0') {
+                printf("missing file name in -b\n");
+                return -1;
+            }
+        } else if (strncmp(argv[i], "-i", 2) == 0) {
+            // -i<state file>: add only the pairs of points appended since the last run
+            state_file = argv[i] + 2;
+            if (*state_file == '\0') {
+                printf("missing file name in -i\n");
+                return -1;
+            }
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            // -j<file>: phase timers and a JSON report of the run
+            report_file = argv[i] + 2;
+            if (*report_file == '\0') {
+                printf("missing file name in -j\n");
+                return -1;
+            }
+            timing = 1;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            dedup = 1;
+        } else if (strcmp(argv[i], "-P") == 0) {
+            pipelined = 1;
+        } else if (strncmp(argv[i], "-k", 2) == 0) {
+            resident = strtol(argv[i] + 2, NULL, 10);
+            if (resident < 2 || resident > MAX_RESIDENT) {
+                printf("number of resident blocks must be between 2 and %d\n", MAX_RESIDENT);
+                return -1;
+            }
+        } else {
+            printf("unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (n_threads < 1) {
+        printf("number of threads must be at least 1\n");
+        return -1;
+    }
+    int rank = 0, ranks = 1;
+#ifdef USE_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+    if (grid > 0 || sampling || cutoff > 0.0 || other_file != NULL || state_file != NULL || pipelined) {
+        printf("-b, -g, -i, -P, -r and -s are not available in the MPI build\n");
+        return -1;
+    }
+#endif
+    if ((grid > 0) + dedup + sampling + (cutoff > 0.0) > 1) {
+        printf("-d, -g, -r and -s cannot be combined\n");
+        return -1;
+    }
+    if ((other_file != NULL || state_file != NULL) && (grid > 0 || sampling || cutoff > 0.0)) {
+        printf("-b and -i cannot be combined with -g, -r or -s\n");
+        return -1;
+    }
+    if (other_file != NULL && state_file != NULL) {
+        printf("-b cannot be combined with -i\n");
+        return -1;
     }
     omp_set_num_threads(n_threads);
 
+    if (!tiles_set) {
+        // column tiles in a quarter of L1 next to the histogram, row tiles in an eighth of L2
+        size_t l1 = cache_size(1), l2 = cache_size(2);
+        if (l1 > 0) {
+            tile_cols = l1 / 4 / (3 * sizeof(int16_t)) / BLOCK_PAD * BLOCK_PAD;
+        }
+        if (l2 > 0) {
+            tile_rows = l2 / 8 / (3 * sizeof(int16_t)) / BLOCK_PAD * BLOCK_PAD;
+        }
+        tile_cols = (tile_cols < BLOCK_PAD) ? BLOCK_PAD : tile_cols;
+        tile_rows = (tile_rows < BLOCK_PAD) ? BLOCK_PAD : (tile_rows > 4096) ? 4096 : tile_rows;
+    }
+
+    // one histogram per thread for the whole run
+    if (mem_reserve(sizeof(bin_bound) + sizeof(bin_hint) + MAP_WINDOW * RECORD_SIZE) != 0) {
+        printf("memory budget too small\n");
+        return -1;
+    }
+    thread_hist_t *hists = hist_alloc(n_threads);
+    if (hists == NULL) {
+        printf("memory budget too small\n");
+        return -1;
+    }
+
+    if (init_bin_tables() != 0) {
+        printf("error building distance bin tables\n");
+        return -1;
+    }
+
     // open the file
     char filename[] = "cells";
-    FILE* file;
-    file = fopen(filename, "r");
-    if (file == NULL) {
+    cells_t cells;
+    if (cells_open(&cells, filename) != 0) {
         printf("error opening file\n");
         return -1;
     }
+    // the checksum reads the whole file, so in the MPI build only rank 0 does it
+    int verified = (cells.binary && rank == 0) ? cells_verify(&cells) : 0;
+#ifdef USE_MPI
+    MPI_Bcast(&verified, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+    if (verified != 0) {
+        printf("checksum mismatch in %s\n", filename);
+        return -1;
+    }
+    
+    cells_t other;
+    if (other_file != NULL) {
+        if (cells_open(&other, other_file) != 0) {
+            printf("error opening file\n");
+            return -1;
+        }
+        if (other.binary && cells_verify(&other) != 0) {
+            printf("checksum mismatch in %s\n", other_file);
+            return -1;
+        }
+    }
     
-    // Check file size and number of lines
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    size_t line_num = (file_size+1)/24;
+    // number of lines
+    size_t line_num = cells.num_points;
+
+    state_t state;
+    uint64_t state_hash = CHECKSUM_INIT;
+    size_t old_points = 0;
+    if (state_file != NULL) {
+        if (state_load(state_file, &state) < 0) {
+            printf("invalid state file %s\n", state_file);
+            return -1;
+        }
+        // the points the state was made of have to be unchanged
+        if (state.num_points > line_num || cells_checksum(&cells, 0, state.num_points, &state_hash) != 0
+                || state_hash != state.checksum) {
+            printf("state file %s does not match %s\n", state_file, filename);
+            return -1;
+        }
+        old_points = state.num_points;
+    }
 
-    long file_cursor = ftell(file); // for store the current file position
-    size_t batch_num;
-    size_t last_batch_size = line_num % BATCH_SIZE;
-    batch_num = (last_batch_size == 0) ? line_num/BATCH_SIZE : line_num/BATCH_SIZE + 1;
-    size_t batch_size = BATCH_SIZE;
+    // the rest of the budget, split between the resident and the loader's blocks
+    int n_blocks = (grid > 0 || sampling || cutoff > 0.0) ? 0 : resident + pipelined;
+    size_t batch_size = (n_blocks > 0) ? block_points(n_blocks, dedup) : 0;
+    size_t naive_batch_size = block_points(2, 0);
+    if (n_blocks > 0 && batch_size == 0) {
+        printf("memory budget too small\n");
+        return -1;
+    }
 
     // allocate memory for storing read lines
-    
-    int16_t (*batch_1)[3] = (int16_t (*)[3])malloc(batch_size * sizeof(int16_t[3]));
-    int16_t (*batch_2)[3] = (int16_t (*)[3])malloc(batch_size * sizeof(int16_t[3]));
-    fseek(file, 0, SEEK_SET); // to the start of the file
-    
-    // Outer loop
-    for (size_t batch_out = 0; batch_out < batch_num; batch_out++) {
-        size_t batch_size1;
-        // check if it is the last batch
-        batch_size1 = batch_size;
-        if (batch_out == (batch_num - 1)) {
-            batch_size1 = last_batch_size;
+    block_t batches[MAX_RESIDENT + 1];
+    for (int ix = 0; ix < n_blocks; ix++) {
+        if (block_alloc(&batches[ix], batch_size, dedup) != 0) {
+            printf("memory budget too small\n");
+            return -1;
+        }
+    }
+    if (dedup) {
+        dedup_scratch = (uint64_t *)mem_alloc(batches[0].capacity * sizeof(uint64_t));
+        if (dedup_scratch == NULL) {
+            printf("memory budget too small\n");
+            return -1;
         }
+    }
+    
+    double start_time = omp_get_wtime();
+    run_stats_t stats;
+    grid_stats_t grid_stats;
+    sample_stats_t sample_stats;
 
-        file_cursor = batch_out * batch_size * 24;
-        fseek(file, file_cursor, SEEK_SET);
+    if (grid > 0) {
+        if (grid_run(&cells, grid, radius, 1, hists, n_threads, &grid_stats) != 0) {
+            return -1;
+        }
+        fprintf(stderr, "grid: %d^3 cells, radius %d, pairs: %lu exact, %lu spread\n",
+            grid, radius, grid_stats.exact_pairs, grid_stats.spread_pairs);
+    } else if (cutoff > 0.0) {
+        // in coordinate units, beyond 35 every distance is below the cutoff anyway
+        cutoff_units = (cutoff < 35.0) ? (int32_t)ceil(cutoff * 1000.0) : 35000;
+        int cells_per_axis = cutoff_grid(cutoff_units);
+        if (grid_run(&cells, cells_per_axis, 1, 0, hists, n_threads, &grid_stats) != 0) {
+            return -1;
+        }
+        fprintf(stderr, "cutoff: %.3f, grid %d^3 cells, %lu pairs counted, bins below %05.2f are exact\n",
+            cutoff, cells_per_axis, grid_stats.exact_pairs, cutoff_bins(cutoff_units) / 100.0);
+    } else if (sampling) {
+        if (sample_run(&cells, &budget, hists, n_threads, &sample_stats) != 0) {
+            printf("error reading file\n");
+            return -1;
+        }
+        fprintf(stderr, "sample: %zu pairs, seed %lu, %.3f s, relative error at the fullest bin %.4f\n",
+            sample_stats.pairs, budget.seed, sample_stats.seconds, sample_stats.rel_error);
+    } else if (other_file != NULL) {
+        // the file with fewer blocks is the one held in groups
+        const cells_t *group = (other.num_points < cells.num_points) ? &other : &cells;
+        const cells_t *stream = (group == &cells) ? &other : &cells;
+        if (run_bipartite(group, stream, batch_size, resident, pipelined, batches, hists, &stats) != 0) {
+            printf("error reading file\n");
+            return -1;
+        }
+    } else if (state_file != NULL) {
+        if (run_incremental(&cells, old_points, batch_size, resident, pipelined, batches, hists, &stats) != 0) {
+            printf("error reading file\n");
+            return -1;
+        }
+    } else {
+#ifdef USE_MPI
+        int status = run_schedule_share(&cells, batch_size, resident, batches, hists, &stats, rank, ranks);
+#else
+        int status = run_schedule(&cells, batch_size, resident, pipelined, batches, hists, &stats);
+#endif
+        if (status != 0) {
+            printf("error reading file\n");
+            return -1;
+        }
+    }
 
-        // prepare batch_1 for outer loop
-        load_batch(batch_1, batch_size1, file);
+    hist_merge(hists, n_threads, counter);
+#ifdef USE_MPI
+    // size_t is unsigned long on the platforms we build on, as the %lu output assumes
+    MPI_Reduce((rank == 0) ? MPI_IN_PLACE : counter, counter, NUM_BINS, MPI_UNSIGNED_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+#endif
+    if (state_file != NULL) {
+        for (size_t bin = 0; bin < NUM_BINS; bin++) {
+            counter[bin] += state.counts[bin];
+            state.counts[bin] = counter[bin];
+        }
+        if (cells_checksum(&cells, old_points, line_num - old_points, &state_hash) != 0) {
+            printf("error reading file\n");
+            return -1;
+        }
+        state.num_points = line_num;
+        state.checksum = state_hash;
+        if (state_save(state_file, &state) != 0) {
+            printf("error writing state file %s\n", state_file);
+            return -1;
+        }
+    }
+    if (grid > 0) {
+        fprintf(stderr, "grid: far pairs spread as if uniform inside every cell, so the bins are estimates\n");
+        grid_report("standard error if uniform", grid_stats.spread_error, counter);
+        grid_report("error bound", grid_stats.spread_bound, counter);
+        // the pairs up to the median distance
+        size_t all = 0, below = 0, median = 0;
+        for (size_t bin = 0; bin < NUM_BINS; bin++) {
+            all += counter[bin];
+        }
+        while (median < NUM_BINS - 1 && (below += counter[median]) < all / 2) {
+            median++;
+        }
+        fprintf(stderr, "grid: error bound %.0f (%.3f%%) of the pairs up to the median bin %05.2f\n",
+            grid_stats.cumulative_bound[median], 100.0 * grid_stats.cumulative_bound[median] / (below > 0 ? below : 1),
+            median / 100.0);
+    }
+    if (cutoff > 0.0) {
+        // the near cells also gave pairs beyond the cutoff, those bins are incomplete
+        for (size_t bin = cutoff_bins(cutoff_units); bin < NUM_BINS; bin++) {
+            counter[bin] = 0;
+        }
+    }
 
-        self_distance(batch_1, batch_size1, counter);
+    // only rank 0 holds the summed histogram, and reports the work of its own share
+    // pairs per second over the whole batch loop
+    double elapsed = omp_get_wtime() - start_time;
+    size_t pairs = (line_num > 0) ? line_num * (line_num - 1) / 2 : 0;
+    if (other_file != NULL) {
+        pairs = line_num * other.num_points;
+    } else if (state_file != NULL) {
+        size_t new_points = line_num - old_points;
+        pairs = new_points * old_points + ((new_points > 0) ? new_points * (new_points - 1) / 2 : 0);
+    }
 
-//        file_cursor = (batch_out+1) * batch_size * 24;
-//        fseek(file, file_cursor, SEEK_SET);
-        
-        // Inner loop
-        for (size_t batch_in = batch_out + 1; batch_in < batch_num; batch_in++) {
-            size_t batch_size2;
-            // check if it is the last batch
-            batch_size2 = batch_size;
-            if (batch_in == (batch_num - 1)) {
-                batch_size2 = last_batch_size;
+    if (report && rank == 0) {
+        // printed to stderr to keep stdout unchanged
+        if (ranks > 1) {
+            fprintf(stderr, "ranks: %d, the lines below are rank 0's\n", ranks);
+        }
+        if (tile_rows == 0) {
+            fprintf(stderr, "tiling: off\n");
+        } else {
+            fprintf(stderr, "tiling: %zux%zu\n", tile_rows, tile_cols);
+        }
+        fprintf(stderr, "pairs: %zu, time: %.3f s, pairs/s: %.3e\n", pairs, elapsed, pairs / elapsed);
+        /* Per-thread work. The kernels are timed up to each thread's own end (nowait),
+        so max / mean of the seconds is the idle tail the other threads waited through. */
+        double self_max = 0.0, self_sum = 0.0, cross_max = 0.0, cross_sum = 0.0;
+        for (int thread = 0; thread < n_threads; thread++) {
+            thread_hist_t *hist = &hists[thread];
+            fprintf(stderr, "thread %d: self %lu pairs %.3f s, cross %lu pairs %.3f s\n", thread,
+                hist->self_pairs, hist->self_seconds, hist->cross_pairs, hist->cross_seconds);
+            self_max = (hist->self_seconds > self_max) ? hist->self_seconds : self_max;
+            cross_max = (hist->cross_seconds > cross_max) ? hist->cross_seconds : cross_max;
+            self_sum += hist->self_seconds;
+            cross_sum += hist->cross_seconds;
+        }
+        fprintf(stderr, "imbalance (max/mean): self %.3f, cross %.3f\n",
+            (self_sum > 0) ? self_max * n_threads / self_sum : 1.0,
+            (cross_sum > 0) ? cross_max * n_threads / cross_sum : 1.0);
+        if (sampling) {
+            // the pair rate above is the extrapolated one, the samples went at this rate
+            fprintf(stderr, "sample: %.3e pairs/s\n", sample_stats.pairs / elapsed);
+        } else if (grid > 0) {
+            fprintf(stderr, "grid: %zu passes, %zu bytes read\n", grid_stats.passes, grid_stats.bytes_read);
+        } else if (other_file != NULL || state_file != NULL) {
+            fprintf(stderr, "blocks: %d resident of %zu points, %zu loads, %zu bytes read\n",
+                resident, batch_size, stats.loads, stats.bytes_read);
+        } else {
+            fprintf(stderr, "blocks: %d resident of %zu points, %zu loads, %zu bytes read (naive order: %zu)\n",
+                resident, batch_size, stats.loads, stats.bytes_read, naive_bytes_read(&cells, naive_batch_size));
+        }
+        fprintf(stderr, "memory: %zu of %zu bytes budgeted\n", mem_used, mem_budget);
+        if (dedup) {
+            fprintf(stderr, "dedup: %zu points loaded, %zu kept (%.1f%%)\n", stats.points_loaded, stats.points_kept,
+                (stats.points_loaded > 0) ? 100.0 * stats.points_kept / stats.points_loaded : 100.0);
+        }
+        if (grid == 0 && !sampling) {
+            fprintf(stderr, "load: %.3f s, waited: %.3f s, hidden: %.3f s\n",
+                stats.load_seconds, stats.wait_seconds, stats.load_seconds - stats.wait_seconds);
+        }
+    }
+    
+    double output_start = phase_start();
+    if (sampling) {
+        sample_print(counter, line_num, &sample_stats);
+    } else if (rank == 0) {
+        for (size_t ix = 0; ix < NUM_BINS; ++ix) {
+            if (counter[ix] != 0) {
+                printf("%05.2f %lu\n", ix/100.0, counter[ix]);
             }
+        }
+    }
 
-            load_batch(batch_2, batch_size2, file);
-
-            double_distance(batch_1, batch_2, batch_size1, batch_size2, counter);
-
-        } // end of inner loop
-    } // end of outerloop
-    
-    for (size_t ix = 0; ix < 3465; ++ix) {
-        if (counter[ix] != 0) {
-            printf("%05.2f %lu\n", ix/100.0, counter[ix]);
+    if (report_file != NULL && rank == 0) {
+        fflush(stdout);
+        double output_seconds = omp_get_wtime() - output_start;
+        const char *mode = sampling ? "sampling" : (grid > 0) ? "grid" : (cutoff > 0.0) ? "cutoff"
+            : (other_file != NULL) ? "bipartite" : (state_file != NULL) ? "incremental" : "full";
+        if (write_report(report_file, mode, line_num, pairs, n_threads, hists, elapsed, output_seconds) != 0) {
+            printf("error writing report %s\n", report_file);
+            return -1;
         }
     }
 
     // close the file
-    fclose(file);
+    cells_close(&cells);
+    if (other_file != NULL) {
+        cells_close(&other);
+    }
     // free memory
-    free(batch_1);
-    free(batch_2);
+    for (int ix = 0; ix < n_blocks; ix++) {
+        block_free(&batches[ix]);
+    }
+    if (dedup) {
+        mem_free(dedup_scratch, batches[0].capacity * sizeof(uint64_t));
+    }
+    hist_free(hists, n_threads);
 
     return 0;
 }
+
+#ifdef USE_MPI
+#undef main
+
+int main(int argc, char* argv[])
+{
+    MPI_Init(&argc, &argv);
+    int status = distances_main(argc, argv);
+    if (status != 0) {
+        // the other ranks may be waiting in the reduction
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Finalize();
+    return status;
+}
+#endif
@@ -1,37 +1,269 @@
+#include <fcntl.h>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "cells.h"
+
+/* Reproducible cells files for testing and benchmarking.
+Usage: generate_cells [-n<points>] [-s<seed>] [-d<distribution>] [-o<file>] [-t<threads>] [-b]
+The same options always give the same file, whatever the thread count: the random
+numbers are counter-based, draw k of point i is a splitmix64 hash of (seed, i, k), so
+any range of points can be made independently. Distributions:
+  uniform    every coordinate uniform in [-10, 10]
+  clustered  normal around CLUSTERS uniform centres, CLUSTER_SIGMA wide
+  dup        uniform points drawn from a pool of points / DUP_FACTOR distinct ones
+Coordinates are made in units of 0.001, the resolution of the format.
+
+The file is made in chunks of CHUNK_POINTS points. Every record has a fixed size, 24
+bytes in text and 6 with -b (the binary format of cells.h), so each thread formats its
+chunk into its own buffer and writes it with pwrite at the chunk's offset. The binary
+checksum runs over the file in order, so it is updated chunk by chunk in an ordered
+section while the other threads go on generating.
+*/
 #define NUM_POINTS 100000
 #define FILENAME "cells_long"
-#define COORD_MIN -10.0
-#define COORD_MAX 10.0
+#define COORD_MIN -10000
+#define COORD_MAX 10000
+#define CLUSTERS 16
+#define CLUSTER_SIGMA 500.0
+#define DUP_FACTOR 64
+#define CHUNK_POINTS 65536
+#define DRAWS_PER_POINT 8
+
+enum { UNIFORM, CLUSTERED, DUP };
+
+typedef struct {
+    int kind;
+    uint64_t point_key;  // draws of the points
+    uint64_t pool_key;   // coordinates of the dup pool
+    uint64_t pool_size;
+    int centres[CLUSTERS][3];
+} generator_t;
+
+// the splitmix64 output function
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// draw number counter of the stream key, the splitmix64 sequence read at any position
+static uint64_t counter_random(uint64_t key, uint64_t counter)
+{
+    return mix64(key + (counter + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+// uniform in [0, 1)
+static double to_unit(uint64_t bits)
+{
+    return (bits >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// 64 random bits to a coordinate
+static int to_coordinate(uint64_t bits)
+{
+    return COORD_MIN + (int)(((unsigned __int128)bits * (COORD_MAX - COORD_MIN + 1)) >> 64);
+}
+
+static int clamp_coordinate(double value)
+{
+    long coord = lround(value);
+    return (coord < COORD_MIN) ? COORD_MIN : (coord > COORD_MAX) ? COORD_MAX : (int)coord;
+}
+
+// one normal deviate (Box-Muller) from two draws
+static double to_normal(uint64_t u_bits, uint64_t v_bits)
+{
+    return sqrt(-2.0 * log(1.0 - to_unit(u_bits))) * cos(2.0 * M_PI * to_unit(v_bits));
+}
+
+static void generator_init(generator_t *gen, int kind, uint64_t seed, uint64_t num_points)
+{
+    gen->kind = kind;
+    gen->point_key = mix64(seed ^ 0x706f696e74730000ULL);
+    gen->pool_key = mix64(seed ^ 0x706f6f6c00000000ULL);
+    gen->pool_size = (num_points + DUP_FACTOR - 1) / DUP_FACTOR;
+    uint64_t centre_key = mix64(seed ^ 0x63656e7472650000ULL);
+    for (int c = 0; c < CLUSTERS; c++) {
+        for (int axis = 0; axis < 3; axis++) {
+            gen->centres[c][axis] = to_coordinate(counter_random(centre_key, c * 3 + axis));
+        }
+    }
+}
 
-// Function to generate a random double between min and max
-double random_coordinate() {
-    return COORD_MIN + ((double)rand() / (double)RAND_MAX) * (COORD_MAX - COORD_MIN);
+static void generate_point(const generator_t *gen, uint64_t index, int point[3])
+{
+    uint64_t counter = index * DRAWS_PER_POINT;
+    if (gen->kind == UNIFORM) {
+        for (int axis = 0; axis < 3; axis++) {
+            point[axis] = to_coordinate(counter_random(gen->point_key, counter + axis));
+        }
+    } else if (gen->kind == CLUSTERED) {
+        const int *centre = gen->centres[counter_random(gen->point_key, counter) % CLUSTERS];
+        for (int axis = 0; axis < 3; axis++) {
+            double normal = to_normal(counter_random(gen->point_key, counter + 1 + 2 * axis),
+                                      counter_random(gen->point_key, counter + 2 + 2 * axis));
+            point[axis] = clamp_coordinate(centre[axis] + CLUSTER_SIGMA * normal);
+        }
+    } else {
+        // pool point k is a function of the pool key and k
+        uint64_t k = counter_random(gen->point_key, counter) % gen->pool_size;
+        for (int axis = 0; axis < 3; axis++) {
+            point[axis] = to_coordinate(mix64(gen->pool_key + 3 * k + axis));
+        }
+    }
+}
+
+// "+01.234" followed by end, 8 bytes, without printf
+static inline void format_coordinate(char *out, int coord, char end)
+{
+    unsigned magnitude = (coord < 0) ? -coord : coord;
+    out[0] = (coord < 0) ? '-' : '+';
+    out[1] = '0' + magnitude / 10000;
+    out[2] = '0' + magnitude / 1000 % 10;
+    out[3] = '.';
+    out[4] = '0' + magnitude / 100 % 10;
+    out[5] = '0' + magnitude / 10 % 10;
+    out[6] = '0' + magnitude % 10;
+    out[7] = end;
+}
+
+static int write_all(int fd, const void *buffer, size_t size, off_t offset)
+{
+    const char *data = buffer;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
 }
 
-int main() {
-    FILE *file = fopen(FILENAME, "w");
-    if (!file) {
+int main(int argc, char *argv[])
+{
+    long num_points = NUM_POINTS;
+    uint64_t seed = 1;
+    const char *distribution = "uniform";
+    const char *filename = FILENAME;
+    int n_threads = omp_get_max_threads();
+    int binary = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-n", 2) == 0) {
+            num_points = strtol(argv[i] + 2, NULL, 10);
+        } else if (strncmp(argv[i], "-s", 2) == 0) {
+            seed = strtoull(argv[i] + 2, NULL, 10);
+        } else if (strncmp(argv[i], "-d", 2) == 0) {
+            distribution = argv[i] + 2;
+        } else if (strncmp(argv[i], "-o", 2) == 0) {
+            filename = argv[i] + 2;
+        } else if (strncmp(argv[i], "-t", 2) == 0) {
+            n_threads = atoi(argv[i] + 2);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            binary = 1;
+        } else {
+            printf("unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (num_points < 0) {
+        printf("number of points must not be negative\n");
+        return 1;
+    }
+    if (n_threads < 1) {
+        printf("number of threads must be at least 1\n");
+        return 1;
+    }
+    int kind = (strcmp(distribution, "uniform") == 0) ? UNIFORM : (strcmp(distribution, "clustered") == 0) ? CLUSTERED
+        : (strcmp(distribution, "dup") == 0) ? DUP : -1;
+    if (kind < 0) {
+        printf("unknown distribution %s, expected uniform, clustered or dup\n", distribution);
+        return 1;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         printf("Error opening file.\n");
         return 1;
     }
 
-    srand(time(NULL));
+    generator_t gen;
+    generator_init(&gen, kind, seed, num_points);
 
-    for (int i = 0; i < NUM_POINTS; i++) {
-        double x = random_coordinate();
-        double y = random_coordinate();
-        double z = random_coordinate();
+    size_t record_size = binary ? BINARY_RECORD_SIZE : RECORD_SIZE;
+    off_t data_offset = binary ? sizeof(cells_header_t) : 0;
+    long n_chunks = (num_points + CHUNK_POINTS - 1) / CHUNK_POINTS;
+    uint64_t checksum = CHECKSUM_INIT;
+    int failed = 0;
 
-        fprintf(file, "%+07.3f %+07.3f %+07.3f\n", x, y, z);
+    #pragma omp parallel num_threads(n_threads)
+    {
+        char *buffer = malloc(CHUNK_POINTS * RECORD_SIZE);
+        if (!buffer) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        #pragma omp for schedule(static, 1) ordered
+        for (long chunk = 0; chunk < n_chunks; chunk++) {
+            long first = chunk * CHUNK_POINTS;
+            long n = (num_points - first < CHUNK_POINTS) ? num_points - first : CHUNK_POINTS;
+            int chunk_failed;
+            #pragma omp atomic read
+            chunk_failed = failed;
+            if (!chunk_failed) {
+                for (long i = 0; i < n; i++) {
+                    int point[3];
+                    generate_point(&gen, first + i, point);
+                    if (binary) {
+                        int16_t *coords = (int16_t *)buffer + 3 * i;
+                        coords[0] = point[0];
+                        coords[1] = point[1];
+                        coords[2] = point[2];
+                    } else {
+                        char *record = buffer + i * RECORD_SIZE;
+                        format_coordinate(record, point[0], ' ');
+                        format_coordinate(record + 8, point[1], ' ');
+                        format_coordinate(record + 16, point[2], '\n');
+                    }
+                }
+                if (write_all(fd, buffer, n * record_size, data_offset + first * record_size) != 0) {
+                    #pragma omp atomic write
+                    failed = 1;
+                }
+            }
+            #pragma omp ordered
+            {
+                if (binary && !chunk_failed) {
+                    checksum = checksum_update(checksum, (int16_t *)buffer, n * 3);
+                }
+            }
+        }
+        free(buffer);
     }
 
-    fclose(file);
+    if (!failed && binary) {
+        cells_header_t header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CELLS_MAGIC, 4);
+        header.version = CELLS_VERSION;
+        header.num_points = num_points;
+        header.checksum = checksum;
+        failed = write_all(fd, &header, sizeof(header), 0) != 0;
+    }
+    if (close(fd) != 0 || failed) {
+        printf("Error writing file.\n");
+        return 1;
+    }
 
-    printf("Coordinates generated and saved to %s\n", FILENAME);
+    printf("%ld %s coordinates generated and saved to %s\n", num_points, distribution, filename);
     return 0;
 }
-
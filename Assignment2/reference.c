@@ -0,0 +1,105 @@
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Brute-force reference histogram for the regression gate (make bench).
+Usage: reference [-t<threads>], reads the text file cells of the current directory.
+Deliberately shares no code with distances: it parses the records with atoi, keeps all
+points in one array and runs the original loop over every pair, with float sqrt and
+(int16_t)(d / 10) like the first calculate_distance. A bug in the bin tables, the
+parser, the SIMD kernel or the block loader of distances therefore shows up as a
+difference instead of being reproduced by the reference. Only for small test files,
+it takes N^2 / 2 sqrt and all points in memory.
+*/
+#define NUM_BINS 3465
+#define LINE_SIZE 24
+
+// "+01.234" -> 1234, the way the original load_batch did it
+static int16_t parse_coord(const char *str)
+{
+    char digits[7];
+    memcpy(digits, str + 1, 2);
+    memcpy(digits + 2, str + 4, 3);
+    digits[5] = '\0';
+    int value = atoi(digits);
+    return (int16_t)((str[0] == '-') ? -value : value);
+}
+
+static inline int16_t calculate_distance(const int16_t *num_1, const int16_t *num_2)
+{
+    float temp = sqrt((num_1[0] - num_2[0]) * (num_1[0] - num_2[0])
+        + (num_1[1] - num_2[1]) * (num_1[1] - num_2[1])
+        + (num_1[2] - num_2[2]) * (num_1[2] - num_2[2]));
+    return (int16_t)(temp / 10);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t counter[NUM_BINS] = {0};
+    int n_threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-t", 2) == 0) {
+            n_threads = strtol(argv[i] + 2, NULL, 10);
+        } else {
+            printf("unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (n_threads < 1) {
+        printf("number of threads must be at least 1\n");
+        return -1;
+    }
+    omp_set_num_threads(n_threads);
+
+    FILE *file = fopen("cells", "r");
+    if (file == NULL) {
+        printf("error opening file\n");
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    size_t line_num = (file_size + 1) / LINE_SIZE;
+
+    int16_t (*points)[3] = (int16_t (*)[3])malloc((line_num > 0 ? line_num : 1) * sizeof(int16_t[3]));
+    if (points == NULL) {
+        printf("out of memory\n");
+        return -1;
+    }
+    char line[LINE_SIZE + 1];
+    for (size_t ix = 0; ix < line_num; ix++) {
+        if (fgets(line, sizeof(line), file) == NULL || strlen(line) < LINE_SIZE - 1) {
+            printf("error reading file\n");
+            return -1;
+        }
+        for (size_t axis = 0; axis < 3; axis++) {
+            points[ix][axis] = parse_coord(line + axis * 8);
+        }
+    }
+    fclose(file);
+
+    size_t ix, jx;
+    int16_t distance;
+
+    #pragma omp parallel for schedule(dynamic, 64) \
+        default(none) private(ix, jx, distance) \
+        shared(points, line_num) reduction(+:counter[:NUM_BINS])
+
+    for (ix = 0; ix < line_num; ix++) {
+        for (jx = ix + 1; jx < line_num; jx++) {
+            distance = calculate_distance(points[ix], points[jx]);
+            counter[distance] += 1;
+        }
+    }
+
+    for (size_t bin = 0; bin < NUM_BINS; ++bin) {
+        if (counter[bin] != 0) {
+            printf("%05.2f %lu\n", bin/100.0, counter[bin]);
+        }
+    }
+    free(points);
+    return 0;
+}
@@ -2,18 +2,61 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <threads.h>
+#include <unistd.h>
+#include <immintrin.h>
 
 /* Constants */
 #define MAX_ITER 128
 #define CONVERGE_THRESHOLD 1e-3
 #define DIVERGE_THRESHOLD 1e10
+#define ROWS_PER_THREAD 4        // rows of the output window per worker thread
+#define SECTOR_BINS 4096         // bins of the root lookup by angle, a power of two
+#define RING_MIN 0.998           // |z|^2 range outside which no root is within CONVERGE_THRESHOLD,
+#define RING_MAX 1.0021          // (1 -+ CONVERGE_THRESHOLD)^2 with some margin
 
-/* Structure to hold thread data */
+/* Structure to hold RGB colors */
+typedef struct {
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+} color_t;
+
+/* Window of rows between the workers and the writer thread.
+Row y lives in slot y % window_rows until it is written. Workers take rows in order
+from next_row and wait while their row is a full window ahead of rows_written, so at
+most window_rows rows of both images are held at any time, whatever the resolution.
+With mirror set, only the rows with imag >= 0 are computed. A slot then also holds the
+mirror image of its row, which the writer puts in place with pwrite (see main). */
 typedef struct {
-    int thread_id;
-    int num_threads;
+    mtx_t lock;
+    cnd_t row_ready;             // a slot was filled, the writer waits on it
+    cnd_t slot_free;             // a row was written, workers wait on it
+    int res;
+    int rows;                    // rows to compute, res or the upper (res + 1) / 2
+    bool mirror;
+    long data_offset;            // where the pixels start in both files
+    int next_row;
+    int rows_written;
+    int window_rows;
+    size_t row_size;             // bytes of one RGB row
+    size_t slot_size;            // bytes of a slot, one row and its mirror image if any
+    unsigned char *ready;        // per slot: the row is complete
+    unsigned char *attractor_rows;
+    unsigned char *convergence_rows;
+    FILE *f_attractor;
+    FILE *f_convergence;
+    bool write_failed;
+} row_window_t;
+
+/* Structure to hold thread data */
+typedef struct thread_data thread_data_t;
+typedef void (*row_kernel_t)(thread_data_t *data, int y, unsigned char *attractor_row, unsigned char *convergence_row,
+                             unsigned char *mirror_row);
+
+struct thread_data {
     int res;
     int deg;
     double real_min;
@@ -22,16 +65,13 @@ typedef struct {
     double imag_max;
     double *roots_real;
     double *roots_imag;
-    unsigned char *attractors;   // Output buffer for attractors
-    unsigned char *convergence;  // Output buffer for convergence
-} thread_data_t;
-
-/* Structure to hold RGB colors */
-typedef struct {
-    unsigned char r;
-    unsigned char g;
-    unsigned char b;
-} color_t;
+    color_t *root_colors;        // deg root colors, then the divergence color
+    color_t *mirror_colors;      // the same for the conjugate image, root k becomes root deg - k
+    row_window_t *window;        // rows are handed out and collected here
+    const int *sector_roots;     // SECTOR_BINS nearest roots by angle, see compute_sectors
+    row_kernel_t compute;        // the kernel for deg, from row_kernels
+    unsigned long mismatches;    // -v: convergence tests that disagree with scan_roots
+};
 
 /* Function to convert HSV to RGB */
 static inline color_t hsv_to_rgb(double h, double s, double v) {
@@ -71,14 +111,75 @@ void compute_roots(int deg, double *roots_real, double *roots_imag) {
     }
 }
 
-/* Fast power function for complex numbers */
-static inline void complex_pow(int deg, double zr, double zi, double *result_r, double *result_i) {
+/* Root lookup by angle.
+The roots of x^d - 1 are evenly spaced on the unit circle, so a z within
+CONVERGE_THRESHOLD of a root lies deep inside that root's sector of angles, and no
+other root needs a distance test. The angle is replaced by the diamond angle
+p in [0, 4), which grows with it and needs one division instead of atan2:
+    p = 1 + sign(x) (t - 1) for y >= 0, and 4 minus that for y < 0, t = |y| / (|x| + |y|)
+compute_sectors stores the nearest root of every bin of SECTOR_BINS bins of p. A bin
+is far narrower than the distance from a root to its sector boundaries, so the
+lookup finds the right root whenever the distance test can succeed. Before that, z
+has to lie in the ring RING_MIN < |z|^2 < RING_MAX around the unit circle, which
+rules out most iterations with the |z|^2 the divergence test needs anyway. */
+void compute_sectors(int deg, int *sector_roots) {
+    for(int b = 0; b < SECTOR_BINS; ++b){
+        // the point of the diamond |x| + |y| = 1 at the middle of the bin
+        double p = (b + 0.5) * 4.0 / SECTOR_BINS;
+        int quadrant = (int)p;
+        double f = p - quadrant;
+        double x, y;
+        if(quadrant == 0){
+            x = 1.0 - f; y = f;
+        } else if(quadrant == 1){
+            x = -f; y = 1.0 - f;
+        } else if(quadrant == 2){
+            x = f - 1.0; y = -f;
+        } else {
+            x = f; y = f - 1.0;
+        }
+        int k = (int)lround(atan2(y, x) * deg / (2.0 * M_PI));
+        sector_roots[b] = ((k % deg) + deg) % deg;
+    }
+}
+
+/* The only root that z can have converged to */
+static inline int sector_root(const int *sector_roots, double z_r, double z_i) {
+    double t = fabs(z_i) / (fabs(z_r) + fabs(z_i));
+    double r = 1.0 + copysign(1.0, z_r) * (t - 1.0);
+    double bin = (2.0 + copysign(1.0, z_i) * (r - 2.0)) * (SECTOR_BINS / 4.0);
+    // z = 0 gives NaN, and p = 4 is angle 0
+    return (bin >= 0.0 && bin < SECTOR_BINS) ? sector_roots[(int)bin] : sector_roots[0];
+}
+
+/* The first root within the threshold by distance to every root, or deg; -v checks the
+sector lookup against it */
+static inline int scan_roots(int deg, const double *roots_real, const double *roots_imag, double z_r, double z_i) {
+    for(int k = 0; k < deg; ++k){
+        double dr = z_r - roots_real[k];
+        double di = z_i - roots_imag[k];
+        double dist_sq = dr * dr + di * di;
+        if(dist_sq < CONVERGE_THRESHOLD * CONVERGE_THRESHOLD){
+            return k;
+        }
+    }
+    return deg;
+}
+
+/* Fast power function for complex numbers, unrolled when deg is a constant */
+static inline __attribute__((always_inline)) void complex_pow(int deg, double zr, double zi, double *result_r, double *result_i) {
     double r = zr;
     double i = zi;
-    double res_r = 1.0;
-    double res_i = 0.0;
+    if(deg == 0){
+        *result_r = 1.0;
+        *result_i = 0.0;
+        return;
+    }
+    double res_r = r;
+    double res_i = i;
 
-    for(int e = 0; e < deg; ++e){
+    #pragma GCC unroll 8
+    for(int e = 1; e < deg; ++e){
         double temp_r = res_r * r - res_i * i;
         double temp_i = res_r * i + res_i * r;
         res_r = temp_r;
@@ -88,97 +189,431 @@ static inline void complex_pow(int deg, double zr, double zi, double *result_r,
     *result_i = res_i;
 }
 
-/* Thread function */
-int thread_func(void *arg){
-    thread_data_t *data = (thread_data_t*) arg;
-    int thread_id = data->thread_id;
-    int num_threads = data->num_threads;
+/* Store one pixel: root color and grayscale iteration count, and the root color of the
+conjugate pixel if there is a mirror row */
+static inline void store_pixel(const thread_data_t *data, int x, int root_found, int iter,
+                               unsigned char *attractor_row, unsigned char *convergence_row, unsigned char *mirror_row){
+    color_t color = data->root_colors[root_found];
+    attractor_row[x * 3]     = color.r;
+    attractor_row[x * 3 +1]  = color.g;
+    attractor_row[x * 3 +2]  = color.b;
+    if(mirror_row){
+        color_t mirror = data->mirror_colors[root_found];
+        mirror_row[x * 3]     = mirror.r;
+        mirror_row[x * 3 +1]  = mirror.g;
+        mirror_row[x * 3 +2]  = mirror.b;
+    }
+
+    unsigned char gray = (iter >= MAX_ITER) ? 255 : (unsigned char)(255.0 * iter / MAX_ITER);
+    convergence_row[x * 3]     = gray;
+    convergence_row[x * 3 +1]  = gray;
+    convergence_row[x * 3 +2]  = gray;
+}
+
+/* Newton iteration for one row, written as RGB straight into the row's slot.
+This is the reference path, used when the build has no AVX (see compute_row_lanes).
+deg and validate are constants in every instance (see ROW_KERNEL), so the powers are
+unrolled and the -v checks cost nothing when off. */
+static inline __attribute__((always_inline)) void compute_row(thread_data_t *data, int y, unsigned char *attractor_row,
+                                                              unsigned char *convergence_row, unsigned char *mirror_row,
+                                                              const int deg, const bool validate){
     int res = data->res;
-    int deg = data->deg;
+    double shrink = (double)(deg - 1) / deg;
     double real_min = data->real_min;
     double real_max = data->real_max;
     double imag_min = data->imag_min;
     double imag_max = data->imag_max;
     double *roots_real = data->roots_real;
     double *roots_imag = data->roots_imag;
-    unsigned char *attractors = data->attractors;
-    unsigned char *convergence = data->convergence;
 
     double real_step = (real_max - real_min) / (double)(res - 1);
     double imag_step = (imag_max - imag_min) / (double)(res - 1);
 
-    // Determine the range of rows this thread will process
-    for(int y = thread_id; y < res; y += num_threads){
-        double zi = imag_max - y * imag_step; // y axis inverted
-        for(int x = 0; x < res; ++x){
-            double zr = real_min + x * real_step;
-            double z_r = zr;
-            double z_i = zi;
-
-            int iter = 0;
-            int root_found = deg; // Initialize to 'diverged'
-
-            while(iter < MAX_ITER){
-                // Compute z^deg
-                double z_pow_r, z_pow_i;
-                complex_pow(deg, z_r, z_i, &z_pow_r, &z_pow_i);
-
-                // f(z) = z^deg - 1
-                double f_r = z_pow_r - 1.0;
-                double f_i = z_pow_i;
-
-                // Compute f'(z) = deg * z^(deg-1)
-                double z_pow_prev_r, z_pow_prev_i;
-                complex_pow(deg - 1, z_r, z_i, &z_pow_prev_r, &z_pow_prev_i);
-                double df_r = deg * z_pow_prev_r;
-                double df_i = deg * z_pow_prev_i;
-
-                // Compute |f'(z)|^2
-                double df_mag_sq = df_r * df_r + df_i * df_i;
-                if(df_mag_sq == 0.0){
-                    break; // Avoid division by zero
-                }
+    double zi = imag_max - y * imag_step; // y axis inverted
+    for(int x = 0; x < res; ++x){
+        double zr = real_min + x * real_step;
+        double z_r = zr;
+        double z_i = zi;
 
-                // Compute f(z)/f'(z)
-                double ratio_r = (f_r * df_r + f_i * df_i) / df_mag_sq;
-                double ratio_i = (f_i * df_r - f_r * df_i) / df_mag_sq;
-
-                // Update z: z = z - f(z)/f'(z)
-                z_r -= ratio_r;
-                z_i -= ratio_i;
-
-                // Check convergence to any root
-                bool converged = false;
-                for(int k = 0; k < deg; ++k){
-                    double dr = z_r - roots_real[k];
-                    double di = z_i - roots_imag[k];
-                    double dist_sq = dr * dr + di * di;
-                    if(dist_sq < CONVERGE_THRESHOLD * CONVERGE_THRESHOLD){
-                        root_found = k;
-                        converged = true;
-                        break;
-                    }
-                }
-                if(converged){
-                    break;
+        int iter = 0;
+        int root_found = deg; // Initialize to 'diverged'
+
+        while(iter < MAX_ITER){
+            // Compute p = z^(deg-1), the only power the step needs
+            double p_r, p_i;
+            complex_pow(deg - 1, z_r, z_i, &p_r, &p_i);
+
+            // Compute |p|^2, zero where f'(z) = deg * p is
+            double p_mag_sq = p_r * p_r + p_i * p_i;
+            if(p_mag_sq == 0.0){
+                break; // Avoid division by zero
+            }
+
+            // Update z: z - (z^deg - 1)/(deg z^(deg-1)) = ((deg-1)/deg) z + 1/(deg p)
+            double scale = 1.0 / (deg * p_mag_sq);
+            z_r = shrink * z_r + p_r * scale;
+            z_i = shrink * z_i - p_i * scale;
+
+            // Check convergence to the root of z's sector, the only candidate
+            double mag_sq = z_r * z_r + z_i * z_i;
+            int k = deg;
+            bool converged = false;
+            if(mag_sq > RING_MIN && mag_sq < RING_MAX){
+                k = sector_root(data->sector_roots, z_r, z_i);
+                double dr = z_r - roots_real[k];
+                double di = z_i - roots_imag[k];
+                converged = dr * dr + di * di < CONVERGE_THRESHOLD * CONVERGE_THRESHOLD;
+            }
+            if(validate && scan_roots(deg, roots_real, roots_imag, z_r, z_i) != (converged ? k : deg)){
+                data->mismatches++;
+            }
+            if(converged){
+                root_found = k;
+                break;
+            }
+
+            // Check divergence conditions
+            if(mag_sq < CONVERGE_THRESHOLD * CONVERGE_THRESHOLD || 
+               fabs(z_r) > DIVERGE_THRESHOLD || 
+               fabs(z_i) > DIVERGE_THRESHOLD){
+                root_found = deg; // 'diverged'
+                break;
+            }
+
+            iter++;
+        }
+
+        store_pixel(data, x, root_found, iter, attractor_row, convergence_row, mirror_row);
+    }
+}
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+/* Newton iteration for LANES pixels of a row at once.
+The lanes take pixels from the row in turn. Every step runs the scalar arithmetic
+operation by operation on all lanes (no fused multiply-add, see the Makefile), so each
+lane takes the same path and gives the same bits as compute_row. A lane whose pixel is
+done, by any of the exits of the scalar loop, is stored and refilled with the next pixel
+of the row, so the vectors stay full until the row runs out. */
+#if defined(__AVX512F__)
+#define LANES 8
+typedef __m512d vdouble;
+static inline vdouble v_set1(double a){ return _mm512_set1_pd(a); }
+static inline vdouble v_load(const double *p){ return _mm512_load_pd(p); }
+static inline void v_store(double *p, vdouble a){ _mm512_store_pd(p, a); }
+static inline vdouble v_add(vdouble a, vdouble b){ return _mm512_add_pd(a, b); }
+static inline vdouble v_sub(vdouble a, vdouble b){ return _mm512_sub_pd(a, b); }
+static inline vdouble v_mul(vdouble a, vdouble b){ return _mm512_mul_pd(a, b); }
+static inline vdouble v_div(vdouble a, vdouble b){ return _mm512_div_pd(a, b); }
+// comparisons give one bit per lane
+static inline int v_lt(vdouble a, vdouble b){ return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+static inline int v_gt(vdouble a, vdouble b){ return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+static inline int v_eq(vdouble a, vdouble b){ return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ); }
+static inline vdouble v_abs(vdouble a){
+    return _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(INT64_MAX)));
+}
+// copysign(1.0, a)
+static inline vdouble v_sign(vdouble a){
+    return _mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(INT64_MIN)),
+                                               _mm512_castpd_si512(_mm512_set1_pd(1.0))));
+}
+// 32-bit indices, one per lane
+typedef __m256i vindex;
+static inline vindex v_index(vdouble a, int mask){ return _mm256_and_si256(_mm512_cvttpd_epi32(a), _mm256_set1_epi32(mask)); }
+static inline vindex v_lookup(const int *table, vindex i){ return _mm256_i32gather_epi32(table, i, 4); }
+static inline vdouble v_gather(const double *table, vindex i){ return _mm512_i32gather_pd(i, table, 8); }
+static inline void v_store_index(int *p, vindex i){ _mm256_storeu_si256((__m256i*)p, i); }
+#else
+#define LANES 4
+typedef __m256d vdouble;
+static inline vdouble v_set1(double a){ return _mm256_set1_pd(a); }
+static inline vdouble v_load(const double *p){ return _mm256_load_pd(p); }
+static inline void v_store(double *p, vdouble a){ _mm256_store_pd(p, a); }
+static inline vdouble v_add(vdouble a, vdouble b){ return _mm256_add_pd(a, b); }
+static inline vdouble v_sub(vdouble a, vdouble b){ return _mm256_sub_pd(a, b); }
+static inline vdouble v_mul(vdouble a, vdouble b){ return _mm256_mul_pd(a, b); }
+static inline vdouble v_div(vdouble a, vdouble b){ return _mm256_div_pd(a, b); }
+// comparisons give one bit per lane
+static inline int v_lt(vdouble a, vdouble b){ return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); }
+static inline int v_gt(vdouble a, vdouble b){ return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ)); }
+static inline int v_eq(vdouble a, vdouble b){ return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ)); }
+static inline vdouble v_abs(vdouble a){ return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+// copysign(1.0, a)
+static inline vdouble v_sign(vdouble a){ return _mm256_or_pd(_mm256_and_pd(a, _mm256_set1_pd(-0.0)), _mm256_set1_pd(1.0)); }
+// 32-bit indices, one per lane
+typedef __m128i vindex;
+static inline vindex v_index(vdouble a, int mask){ return _mm_and_si128(_mm256_cvttpd_epi32(a), _mm_set1_epi32(mask)); }
+static inline vindex v_lookup(const int *table, vindex i){ return _mm_i32gather_epi32(table, i, 4); }
+static inline vdouble v_gather(const double *table, vindex i){ return _mm256_i32gather_pd(table, i, 8); }
+static inline void v_store_index(int *p, vindex i){ _mm_storeu_si128((__m128i*)p, i); }
+#endif
+
+/* sector_root on all lanes; out of range bins (z = 0, NaN) wrap into the table */
+static inline vindex v_sector_root(const int *sector_roots, vdouble z_r, vdouble z_i){
+    const vdouble one = v_set1(1.0);
+    const vdouble two = v_set1(2.0);
+    vdouble t = v_div(v_abs(z_i), v_add(v_abs(z_r), v_abs(z_i)));
+    vdouble r = v_add(one, v_mul(v_sign(z_r), v_sub(t, one)));
+    vdouble p = v_add(two, v_mul(v_sign(z_i), v_sub(r, two)));
+    return v_lookup(sector_roots, v_index(v_mul(p, v_set1(SECTOR_BINS / 4.0)), SECTOR_BINS - 1));
+}
+
+/* complex_pow on all lanes, with the same operations */
+static inline __attribute__((always_inline)) void v_complex_pow(int deg, vdouble zr, vdouble zi, vdouble *result_r, vdouble *result_i) {
+    if(deg == 0){
+        *result_r = v_set1(1.0);
+        *result_i = v_set1(0.0);
+        return;
+    }
+    vdouble res_r = zr;
+    vdouble res_i = zi;
+
+    #pragma GCC unroll 8
+    for(int e = 1; e < deg; ++e){
+        vdouble temp_r = v_sub(v_mul(res_r, zr), v_mul(res_i, zi));
+        vdouble temp_i = v_add(v_mul(res_r, zi), v_mul(res_i, zr));
+        res_r = temp_r;
+        res_i = temp_i;
+    }
+    *result_r = res_r;
+    *result_i = res_i;
+}
+
+static inline __attribute__((always_inline)) void compute_row_lanes(thread_data_t *data, int y, unsigned char *attractor_row,
+                                                                    unsigned char *convergence_row, unsigned char *mirror_row,
+                                                                    const int deg, const bool validate){
+    int res = data->res;
+    double *roots_real = data->roots_real;
+    double *roots_imag = data->roots_imag;
+
+    double real_step = (data->real_max - data->real_min) / (double)(res - 1);
+    double imag_step = (data->imag_max - data->imag_min) / (double)(res - 1);
+    double zi = data->imag_max - y * imag_step; // y axis inverted
+
+    const vdouble one = v_set1(1.0);
+    const vdouble zero = v_set1(0.0);
+    const vdouble degree = v_set1((double)deg);
+    const vdouble shrink = v_set1((double)(deg - 1) / deg);
+    const vdouble converge_sq = v_set1(CONVERGE_THRESHOLD * CONVERGE_THRESHOLD);
+    const vdouble ring_min = v_set1(RING_MIN);
+    const vdouble ring_max = v_set1(RING_MAX);
+    const vdouble diverge = v_set1(DIVERGE_THRESHOLD);
+    const vdouble minus_diverge = v_set1(-DIVERGE_THRESHOLD);
+
+    // lane state: its pixel, z and iteration count, spilled only when a lane changes pixel
+    double lane_r[LANES] __attribute__((aligned(64)));
+    double lane_i[LANES] __attribute__((aligned(64)));
+    int lane_x[LANES];
+    int lane_iter[LANES];
+    int lane_root[LANES];
+    int active = 0;
+    int next_x = 0;
+    for(int lane = 0; lane < LANES; ++lane){
+        lane_r[lane] = 1.0;
+        lane_i[lane] = 0.0;
+        if(next_x < res){
+            lane_x[lane] = next_x;
+            lane_r[lane] = data->real_min + next_x * real_step;
+            lane_i[lane] = zi;
+            lane_iter[lane] = 0;
+            active |= 1 << lane;
+            next_x++;
+        }
+    }
+    vdouble z_r = v_load(lane_r);
+    vdouble z_i = v_load(lane_i);
+
+    while(active){
+        // p = z^(deg-1)
+        vdouble p_r, p_i;
+        v_complex_pow(deg - 1, z_r, z_i, &p_r, &p_i);
+
+        // lanes with f'(z) = 0 stop before the update, as in the scalar loop
+        vdouble p_mag_sq = v_add(v_mul(p_r, p_r), v_mul(p_i, p_i));
+        int done = v_eq(p_mag_sq, zero) & active;
+
+        // z = ((deg-1)/deg) z + 1/(deg p)
+        vdouble scale = v_div(one, v_mul(degree, p_mag_sq));
+        z_r = v_add(v_mul(shrink, z_r), v_mul(p_r, scale));
+        z_i = v_sub(v_mul(shrink, z_i), v_mul(p_i, scale));
+
+        // distance to the root of each lane's sector, the only candidate, for lanes near the unit circle
+        vdouble mag_sq = v_add(v_mul(z_r, z_r), v_mul(z_i, z_i));
+        int tested = active & ~done;
+        int ring = v_gt(mag_sq, ring_min) & v_lt(mag_sq, ring_max) & tested;
+        int converged = 0;
+        if(ring){
+            vindex sector = v_sector_root(data->sector_roots, z_r, z_i);
+            vdouble dr = v_sub(z_r, v_gather(roots_real, sector));
+            vdouble di = v_sub(z_i, v_gather(roots_imag, sector));
+            converged = v_lt(v_add(v_mul(dr, dr), v_mul(di, di)), converge_sq) & ring;
+            v_store_index(lane_root, sector);
+        }
+        if(validate){
+            double check_r[LANES] __attribute__((aligned(64)));
+            double check_i[LANES] __attribute__((aligned(64)));
+            v_store(check_r, z_r);
+            v_store(check_i, z_i);
+            for(int lane = 0; lane < LANES; ++lane){
+                if((tested & (1 << lane)) && scan_roots(deg, roots_real, roots_imag, check_r[lane], check_i[lane])
+                                             != ((converged & (1 << lane)) ? lane_root[lane] : deg)){
+                    data->mismatches++;
                 }
+            }
+        }
+        done |= converged;
 
-                // Check divergence conditions
-                double mag_sq = z_r * z_r + z_i * z_i;
-                if(mag_sq < CONVERGE_THRESHOLD * CONVERGE_THRESHOLD || 
-                   fabs(z_r) > DIVERGE_THRESHOLD || 
-                   fabs(z_i) > DIVERGE_THRESHOLD){
-                    root_found = deg; // 'diverged'
-                    break;
+        // divergence, fabs(z) > DIVERGE_THRESHOLD written as two comparisons
+        done |= (v_lt(mag_sq, converge_sq) | v_gt(z_r, diverge) | v_lt(z_r, minus_diverge)
+                 | v_gt(z_i, diverge) | v_lt(z_i, minus_diverge)) & active;
+
+        for(int lane = 0; lane < LANES; ++lane){
+            if((active & ~done) & (1 << lane)){
+                if(++lane_iter[lane] >= MAX_ITER){
+                    done |= 1 << lane;
                 }
+            }
+        }
+        if(!done){
+            continue;
+        }
 
-                iter++;
+        // store the finished pixels and refill their lanes
+        v_store(lane_r, z_r);
+        v_store(lane_i, z_i);
+        for(int lane = 0; lane < LANES; ++lane){
+            if(!(done & (1 << lane))){
+                continue;
+            }
+            int root_found = (converged & (1 << lane)) ? lane_root[lane] : deg;
+            store_pixel(data, lane_x[lane], root_found, lane_iter[lane], attractor_row, convergence_row, mirror_row);
+            if(next_x < res){
+                lane_x[lane] = next_x;
+                lane_r[lane] = data->real_min + next_x * real_step;
+                lane_i[lane] = zi;
+                lane_iter[lane] = 0;
+                next_x++;
             }
+            else{
+                active &= ~(1 << lane);
+            }
+        }
+        z_r = v_load(lane_r);
+        z_i = v_load(lane_i);
+    }
+}
+#endif
+
+/* One row kernel per degree, so every power has a constant length, and a second one
+with the -v checks. main picks the kernel for the run from row_kernels. */
+#ifdef LANES
+#define ROW_KERNEL(d) \
+    static void compute_row_x##d(thread_data_t *data, int y, unsigned char *attractor_row, unsigned char *convergence_row, \
+                                 unsigned char *mirror_row){ \
+        compute_row_lanes(data, y, attractor_row, convergence_row, mirror_row, d, false); \
+    } \
+    static void check_row_x##d(thread_data_t *data, int y, unsigned char *attractor_row, unsigned char *convergence_row, \
+                               unsigned char *mirror_row){ \
+        compute_row_lanes(data, y, attractor_row, convergence_row, mirror_row, d, true); \
+    }
+#else
+#define ROW_KERNEL(d) \
+    static void compute_row_x##d(thread_data_t *data, int y, unsigned char *attractor_row, unsigned char *convergence_row, \
+                                 unsigned char *mirror_row){ \
+        compute_row(data, y, attractor_row, convergence_row, mirror_row, d, false); \
+    } \
+    static void check_row_x##d(thread_data_t *data, int y, unsigned char *attractor_row, unsigned char *convergence_row, \
+                               unsigned char *mirror_row){ \
+        compute_row(data, y, attractor_row, convergence_row, mirror_row, d, true); \
+    }
+#endif
+ROW_KERNEL(1)
+ROW_KERNEL(2)
+ROW_KERNEL(3)
+ROW_KERNEL(4)
+ROW_KERNEL(5)
+ROW_KERNEL(6)
+ROW_KERNEL(7)
+ROW_KERNEL(8)
+ROW_KERNEL(9)
+
+static const row_kernel_t row_kernels[2][10] = {
+    {NULL, compute_row_x1, compute_row_x2, compute_row_x3, compute_row_x4,
+     compute_row_x5, compute_row_x6, compute_row_x7, compute_row_x8, compute_row_x9},
+    {NULL, check_row_x1, check_row_x2, check_row_x3, check_row_x4,
+     check_row_x5, check_row_x6, check_row_x7, check_row_x8, check_row_x9}
+};
+
+/* Thread function: take the next row, wait for its slot, compute it and publish it */
+int thread_func(void *arg){
+    thread_data_t *data = (thread_data_t*) arg;
+    row_window_t *window = data->window;
+
+    for(;;){
+        mtx_lock(&window->lock);
+        int y = window->next_row;
+        if(y >= window->rows){
+            mtx_unlock(&window->lock);
+            break;
+        }
+        window->next_row++;
+        while(y >= window->rows_written + window->window_rows){
+            cnd_wait(&window->slot_free, &window->lock);
+        }
+        mtx_unlock(&window->lock);
+
+        // the slot is ours until the writer is done with it
+        int slot = y % window->window_rows;
+        unsigned char *attractor_row = window->attractor_rows + slot * window->slot_size;
+        unsigned char *convergence_row = window->convergence_rows + slot * window->slot_size;
+        data->compute(data, y, attractor_row, convergence_row, window->mirror ? attractor_row + window->row_size : NULL);
+        if(window->mirror){
+            // conjugation keeps the iteration counts
+            memcpy(convergence_row + window->row_size, convergence_row, window->row_size);
+        }
+
+        mtx_lock(&window->lock);
+        window->ready[slot] = 1;
+        cnd_signal(&window->row_ready);
+        mtx_unlock(&window->lock);
+    }
+    return 0;
+}
+
+/* Writer thread: stream the rows to both PPM files in order as they complete, and put
+their mirror images in the lower half */
+int writer_func(void *arg){
+    row_window_t *window = (row_window_t*) arg;
 
-            // Store results
-            attractors[y * res + x] = (unsigned char)root_found;
-            convergence[y * res + x] = (iter >= MAX_ITER) ? 255 : (unsigned char)(255.0 * iter / MAX_ITER);
+    for(int y = 0; y < window->rows; ++y){
+        int slot = y % window->window_rows;
+        mtx_lock(&window->lock);
+        while(!window->ready[slot]){
+            cnd_wait(&window->row_ready, &window->lock);
+        }
+        mtx_unlock(&window->lock);
+
+        // Write the entire row at once
+        unsigned char *attractor_row = window->attractor_rows + slot * window->slot_size;
+        unsigned char *convergence_row = window->convergence_rows + slot * window->slot_size;
+        if(fwrite(attractor_row, 1, window->row_size, window->f_attractor) != window->row_size ||
+           fwrite(convergence_row, 1, window->row_size, window->f_convergence) != window->row_size){
+            window->write_failed = true;
         }
+        // pwrite leaves the file offset, and so the sequential writes above, alone
+        int mirror_y = window->res - 1 - y;
+        if(window->mirror && mirror_y != y){
+            off_t offset = window->data_offset + (off_t)mirror_y * window->row_size;
+            if(pwrite(fileno(window->f_attractor), attractor_row + window->row_size, window->row_size, offset) != (ssize_t)window->row_size ||
+               pwrite(fileno(window->f_convergence), convergence_row + window->row_size, window->row_size, offset) != (ssize_t)window->row_size){
+                window->write_failed = true;
+            }
+        }
+
+        mtx_lock(&window->lock);
+        window->ready[slot] = 0;
+        window->rows_written = y + 1;
+        cnd_broadcast(&window->slot_free);
+        mtx_unlock(&window->lock);
     }
     return 0;
 }
@@ -186,13 +621,14 @@ int thread_func(void *arg){
 /* Main function */
 int main(int argc, char *argv[]){
     if(argc < 4){
-        fprintf(stderr, "Usage: %s -t<num_threads> -l<resolution> <degree>\n", argv[0]);
+        fprintf(stderr, "Usage: %s -t<num_threads> -l<resolution> [-v] <degree>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     int num_threads = 1;
     int res = 1000;
     int deg = 3;
+    bool validate = false;  // -v: check the root lookup against the scan of all roots
 
     /* Parse command line arguments */
     for(int i =1; i < argc -1; ++i){
@@ -210,6 +646,9 @@ int main(int argc, char *argv[]){
                 return EXIT_FAILURE;
             }
         }
+        else if(strcmp(argv[i], "-v") ==0){
+            validate = true;
+        }
         else{
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
             return EXIT_FAILURE;
@@ -233,83 +672,23 @@ int main(int argc, char *argv[]){
         return EXIT_FAILURE;
     }
     compute_roots(deg, roots_real, roots_imag);
-
-    /* Allocate output buffers */
-    size_t total_pixels = (size_t)res * res;
-    unsigned char *attractors = malloc(sizeof(unsigned char) * total_pixels);
-    unsigned char *convergence = malloc(sizeof(unsigned char) * total_pixels);
-    if(!attractors || !convergence){
-        fprintf(stderr, "Memory allocation failed for output buffers.\n");
-        free(roots_real);
-        free(roots_imag);
-        if(attractors) free(attractors);
-        if(convergence) free(convergence);
-        return EXIT_FAILURE;
-    }
-
-    /* Initialize output buffers */
-    memset(attractors, 0, sizeof(unsigned char) * total_pixels);
-    memset(convergence, 0, sizeof(unsigned char) * total_pixels);
-
-    /* Prepare thread data */
-    thrd_t *threads = malloc(sizeof(thrd_t) * num_threads);
-    thread_data_t *thread_data = malloc(sizeof(thread_data_t) * num_threads);
-    if(!threads || !thread_data){
-        fprintf(stderr, "Memory allocation failed for threads.\n");
-        free(roots_real);
-        free(roots_imag);
-        free(attractors);
-        free(convergence);
-        if(threads) free(threads);
-        if(thread_data) free(thread_data);
-        return EXIT_FAILURE;
-    }
-
-    for(int i=0; i < num_threads; ++i){
-        thread_data[i].thread_id = i;
-        thread_data[i].num_threads = num_threads;
-        thread_data[i].res = res;
-        thread_data[i].deg = deg;
-        thread_data[i].real_min = -2.0;
-        thread_data[i].real_max = 2.0;
-        thread_data[i].imag_min = -2.0;
-        thread_data[i].imag_max = 2.0;
-        thread_data[i].roots_real = roots_real;
-        thread_data[i].roots_imag = roots_imag;
-        thread_data[i].attractors = attractors;
-        thread_data[i].convergence = convergence;
-
-        if(thrd_create(&threads[i], thread_func, &thread_data[i]) != thrd_success){
-            fprintf(stderr, "Failed to create thread %d\n", i);
-            // Cleanup
-            for(int j=0; j < i; ++j){
-                thrd_join(threads[j], NULL);
-            }
-            free(roots_real);
-            free(roots_imag);
-            free(attractors);
-            free(convergence);
-            free(threads);
-            free(thread_data);
-            return EXIT_FAILURE;
-        }
-    }
-
-    /* Wait for threads to finish */
-    for(int i=0; i < num_threads; ++i){
-        thrd_join(threads[i], NULL);
-    }
-
-    /* Generate colors for roots */
-    color_t *root_colors = malloc(sizeof(color_t) * (deg +1)); // +1 for divergence
+    int sector_roots[SECTOR_BINS];
+    compute_sectors(deg, sector_roots);
+
+    /* Viewport; the basins of x^d - 1 are symmetric under conjugation, so when the
+    imaginary range is too only the upper half is computed and mirrored */
+    double real_min = -2.0;
+    double real_max = 2.0;
+    double imag_min = -2.0;
+    double imag_max = 2.0;
+    bool symmetric = (imag_min == -imag_max);
+
+    /* Generate colors for roots, and for their conjugates after them */
+    color_t *root_colors = malloc(sizeof(color_t) * 2 * (deg +1)); // +1 for divergence
     if(!root_colors){
         fprintf(stderr, "Memory allocation failed for root colors.\n");
         free(roots_real);
         free(roots_imag);
-        free(threads);
-        free(thread_data);
-        free(attractors);
-        free(convergence);
         return EXIT_FAILURE;
     }
 
@@ -321,6 +700,11 @@ int main(int argc, char *argv[]){
     root_colors[deg].r = 0;
     root_colors[deg].g = 0;
     root_colors[deg].b = 0;
+    // conj(root k) = root (deg - k) % deg, divergence stays black
+    color_t *mirror_colors = root_colors + deg + 1;
+    for(int k=0; k <= deg; ++k){
+        mirror_colors[k] = root_colors[(k < deg) ? (deg - k) % deg : deg];
+    }
 
     /* Open PPM files in binary mode */
     char attractor_filename[50];
@@ -334,10 +718,6 @@ int main(int argc, char *argv[]){
         fprintf(stderr, "Failed to open output files.\n");
         free(roots_real);
         free(roots_imag);
-        free(threads);
-        free(thread_data);
-        free(attractors);
-        free(convergence);
         free(root_colors);
         if(f_attractor) fclose(f_attractor);
         if(f_convergence) fclose(f_convergence);
@@ -347,67 +727,126 @@ int main(int argc, char *argv[]){
     /* Write PPM headers (P6 - binary) */
     fprintf(f_attractor, "P6\n%d %d\n255\n", res, res);
     fprintf(f_convergence, "P6\n%d %d\n255\n", res, res);
-
-    /* Prepare buffer for row data */
-    size_t row_size = (size_t)res * 3; // RGB per pixel
-    unsigned char *attractor_row = malloc(sizeof(unsigned char) * row_size);
-    unsigned char *convergence_row = malloc(sizeof(unsigned char) * row_size);
-    if(!attractor_row || !convergence_row){
-        fprintf(stderr, "Memory allocation failed for PPM rows.\n");
+    long data_offset = ftell(f_attractor); // the same in both files
+
+    /* Row window: ROWS_PER_THREAD rows of each image per worker, instead of both full images */
+    row_window_t window;
+    window.res = res;
+    window.mirror = symmetric;
+    window.rows = symmetric ? (res + 1) / 2 : res;
+    window.data_offset = data_offset;
+    window.next_row = 0;
+    window.rows_written = 0;
+    window.window_rows = (num_threads * ROWS_PER_THREAD < window.rows) ? num_threads * ROWS_PER_THREAD : window.rows;
+    window.row_size = (size_t)res * 3; // RGB per pixel
+    window.slot_size = window.row_size * (symmetric ? 2 : 1);
+    window.ready = calloc(window.window_rows, sizeof(unsigned char));
+    window.attractor_rows = malloc(window.slot_size * window.window_rows);
+    window.convergence_rows = malloc(window.slot_size * window.window_rows);
+    window.f_attractor = f_attractor;
+    window.f_convergence = f_convergence;
+    window.write_failed = false;
+    thrd_t *threads = malloc(sizeof(thrd_t) * num_threads);
+    thread_data_t *thread_data = malloc(sizeof(thread_data_t) * num_threads);
+    if(!window.ready || !window.attractor_rows || !window.convergence_rows || !threads || !thread_data){
+        fprintf(stderr, "Memory allocation failed for the row window.\n");
         fclose(f_attractor);
         fclose(f_convergence);
         free(roots_real);
         free(roots_imag);
+        free(root_colors);
+        free(window.ready);
+        free(window.attractor_rows);
+        free(window.convergence_rows);
         free(threads);
         free(thread_data);
-        free(attractors);
-        free(convergence);
+        return EXIT_FAILURE;
+    }
+    mtx_init(&window.lock, mtx_plain);
+    cnd_init(&window.row_ready);
+    cnd_init(&window.slot_free);
+
+    /* Start the writer, then the workers */
+    thrd_t writer;
+    if(thrd_create(&writer, writer_func, &window) != thrd_success){
+        fprintf(stderr, "Failed to create writer thread\n");
+        fclose(f_attractor);
+        fclose(f_convergence);
+        free(roots_real);
+        free(roots_imag);
         free(root_colors);
-        if(attractor_row) free(attractor_row);
-        if(convergence_row) free(convergence_row);
+        free(window.ready);
+        free(window.attractor_rows);
+        free(window.convergence_rows);
+        free(threads);
+        free(thread_data);
         return EXIT_FAILURE;
     }
 
-    /* Write pixel data */
-    for(int y=0; y < res; ++y){
-        for(int x=0; x < res; ++x){
-            int idx = y * res + x;
-            int root_idx = attractors[idx];
-            color_t color;
-            if(root_idx >=0 && root_idx < deg){
-                color = root_colors[root_idx];
-            }
-            else{
-                color = root_colors[deg]; // Diverged
-            }
-            attractor_row[x * 3]     = color.r;
-            attractor_row[x * 3 +1]  = color.g;
-            attractor_row[x * 3 +2]  = color.b;
-
-            // Convergence: grayscale
-            unsigned char gray = convergence[idx];
-            convergence_row[x * 3]     = gray;
-            convergence_row[x * 3 +1]  = gray;
-            convergence_row[x * 3 +2]  = gray;
+    int started = 0;
+    for(int i=0; i < num_threads; ++i){
+        thread_data[i].res = res;
+        thread_data[i].deg = deg;
+        thread_data[i].real_min = real_min;
+        thread_data[i].real_max = real_max;
+        thread_data[i].imag_min = imag_min;
+        thread_data[i].imag_max = imag_max;
+        thread_data[i].roots_real = roots_real;
+        thread_data[i].roots_imag = roots_imag;
+        thread_data[i].root_colors = root_colors;
+        thread_data[i].mirror_colors = mirror_colors;
+        thread_data[i].window = &window;
+        thread_data[i].sector_roots = sector_roots;
+        thread_data[i].compute = row_kernels[validate][deg];
+        thread_data[i].mismatches = 0;
+
+        if(thrd_create(&threads[i], thread_func, &thread_data[i]) != thrd_success){
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            break;
         }
-        // Write the entire row at once
-        fwrite(attractor_row, sizeof(unsigned char), row_size, f_attractor);
-        fwrite(convergence_row, sizeof(unsigned char), row_size, f_convergence);
+        started++;
+    }
+    if(started == 0){
+        // nobody will fill the rows the writer waits for, exiting ends it
+        return EXIT_FAILURE;
     }
 
+    /* Wait for threads to finish, the started ones cover all rows */
+    for(int i=0; i < started; ++i){
+        thrd_join(threads[i], NULL);
+    }
+    thrd_join(writer, NULL);
+
     /* Cleanup */
-    fclose(f_attractor);
-    fclose(f_convergence);
+    int status = EXIT_SUCCESS;
+    if(validate){
+        unsigned long mismatches = 0;
+        for(int i=0; i < started; ++i){
+            mismatches += thread_data[i].mismatches;
+        }
+        printf("root lookup: %lu mismatches against the scan of all roots\n", mismatches);
+        if(mismatches != 0){
+            status = EXIT_FAILURE;
+        }
+    }
+    if(window.write_failed || ferror(f_attractor) || ferror(f_convergence)){
+        fprintf(stderr, "Failed to write output files.\n");
+        status = EXIT_FAILURE;
+    }
+    if(fclose(f_attractor) != 0 || fclose(f_convergence) != 0){
+        status = EXIT_FAILURE;
+    }
+    mtx_destroy(&window.lock);
+    cnd_destroy(&window.row_ready);
+    cnd_destroy(&window.slot_free);
     free(roots_real);
     free(roots_imag);
+    free(root_colors);
+    free(window.ready);
+    free(window.attractor_rows);
+    free(window.convergence_rows);
     free(threads);
     free(thread_data);
-    free(attractors);
-    free(convergence);
-    free(root_colors);
-    free(attractor_row);
-    free(convergence_row);
 
-    return EXIT_SUCCESS;
+    return status;
 }
-